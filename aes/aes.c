@@ -1,6 +1,32 @@
 #include <aes.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/kdf.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct aes_ctx {
+  uint8_t key[AES_KEY_LENGTH_BYTE];
+  EVP_CIPHER_CTX *enc;
+  EVP_CIPHER_CTX *dec;
+  // Raw block ciphers for the batch API, CBC chaining is done by hand
+  EVP_CIPHER_CTX *ecb_enc;
+  EVP_CIPHER_CTX *ecb_dec;
+  EVP_MAC_CTX *mac; // Keyed HMAC-SHA256, re-initialised per tag
+  uint8_t *scratch;
+  size_t scratch_cap;
+};
+
+struct aes_thread_cache {
+  aes_ctx_t *ctx[AES_THREAD_CACHE_SIZE];
+  int next; // Round-robin eviction
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
 
 void encryptAES(const uint8_t *input, size_t input_len, const uint8_t *key,
                 const uint8_t *iv, uint8_t *output) {
@@ -39,3 +65,304 @@ void decryptAES(const uint8_t *ciphertext, size_t ciphertext_len,
 
   EVP_CIPHER_CTX_free(ctx);
 }
+
+// HKDF-SHA256 of the AES key, so routing tags do not use the cipher key
+static int derive_route_key(const uint8_t *key,
+                            uint8_t route_key[AES_KEY_LENGTH_BYTE]) {
+  EVP_KDF *hkdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+  EVP_KDF_CTX *kdf = hkdf ? EVP_KDF_CTX_new(hkdf) : NULL;
+  EVP_KDF_free(hkdf);
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void *)key,
+                                        AES_KEY_LENGTH_BYTE),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO,
+                                        AES_ROUTE_KEY_INFO,
+                                        sizeof(AES_ROUTE_KEY_INFO) - 1),
+      OSSL_PARAM_construct_end()};
+  int ok = kdf && EVP_KDF_derive(kdf, route_key, AES_KEY_LENGTH_BYTE, params);
+  EVP_KDF_CTX_free(kdf);
+  return ok ? 0 : -1;
+}
+
+aes_ctx_t *aes_ctx_new(const uint8_t *key) {
+  aes_ctx_t *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+
+  memcpy(ctx->key, key, AES_KEY_LENGTH_BYTE);
+  ctx->enc = EVP_CIPHER_CTX_new();
+  ctx->dec = EVP_CIPHER_CTX_new();
+  ctx->ecb_enc = EVP_CIPHER_CTX_new();
+  ctx->ecb_dec = EVP_CIPHER_CTX_new();
+  // Expand the key schedules once; the IV is loaded per message
+  if (!ctx->enc || !ctx->dec || !ctx->ecb_enc || !ctx->ecb_dec ||
+      !EVP_EncryptInit_ex(ctx->enc, EVP_aes_256_cbc(), NULL, key, NULL) ||
+      !EVP_DecryptInit_ex(ctx->dec, EVP_aes_256_cbc(), NULL, key, NULL) ||
+      !EVP_EncryptInit_ex(ctx->ecb_enc, EVP_aes_256_ecb(), NULL, key, NULL) ||
+      !EVP_DecryptInit_ex(ctx->ecb_dec, EVP_aes_256_ecb(), NULL, key, NULL)) {
+    aes_ctx_free(ctx);
+    return NULL;
+  }
+  EVP_CIPHER_CTX_set_padding(ctx->ecb_enc, 0);
+  EVP_CIPHER_CTX_set_padding(ctx->ecb_dec, 0);
+
+  uint8_t route_key[AES_KEY_LENGTH_BYTE];
+  if (derive_route_key(key, route_key) < 0) {
+    aes_ctx_free(ctx);
+    return NULL;
+  }
+  EVP_MAC *hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+  ctx->mac = hmac ? EVP_MAC_CTX_new(hmac) : NULL;
+  EVP_MAC_free(hmac);
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+      OSSL_PARAM_construct_end()};
+  int mac_ok =
+      ctx->mac && EVP_MAC_init(ctx->mac, route_key, sizeof(route_key), params);
+  OPENSSL_cleanse(route_key, sizeof(route_key));
+  if (!mac_ok) {
+    aes_ctx_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void aes_ctx_free(aes_ctx_t *ctx) {
+  if (!ctx)
+    return;
+  EVP_CIPHER_CTX_free(ctx->enc);
+  EVP_CIPHER_CTX_free(ctx->dec);
+  EVP_CIPHER_CTX_free(ctx->ecb_enc);
+  EVP_CIPHER_CTX_free(ctx->ecb_dec);
+  EVP_MAC_CTX_free(ctx->mac);
+  OPENSSL_cleanse(ctx->key, sizeof(ctx->key));
+  if (ctx->scratch)
+    OPENSSL_cleanse(ctx->scratch, ctx->scratch_cap);
+  free(ctx->scratch);
+  free(ctx);
+}
+
+int aes_ctx_encrypt(aes_ctx_t *ctx, const uint8_t *input, size_t input_len,
+                    const uint8_t *iv, uint8_t *output) {
+  int len, final_len;
+
+  // NULL cipher and key keep the expanded key, only the IV is reset
+  if (!EVP_EncryptInit_ex(ctx->enc, NULL, NULL, NULL, iv) ||
+      !EVP_EncryptUpdate(ctx->enc, output, &len, input, input_len) ||
+      !EVP_EncryptFinal_ex(ctx->enc, output + len, &final_len))
+    return -1;
+  return len + final_len;
+}
+
+int aes_ctx_decrypt(aes_ctx_t *ctx, const uint8_t *ciphertext,
+                    size_t ciphertext_len, const uint8_t *iv, uint8_t *output) {
+  int len, final_len;
+
+  if (!EVP_DecryptInit_ex(ctx->dec, NULL, NULL, NULL, iv) ||
+      !EVP_DecryptUpdate(ctx->dec, output, &len, ciphertext, ciphertext_len) ||
+      !EVP_DecryptFinal_ex(ctx->dec, output + len, &final_len))
+    return -1;
+  return len + final_len;
+}
+
+int aes_ctx_route_tag(aes_ctx_t *ctx, const uint8_t *data, size_t len,
+                      uint8_t tag[AES_ROUTE_TAG_LENGTH]) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  size_t md_len;
+
+  // A NULL key restarts from the already keyed HMAC state
+  if (!EVP_MAC_init(ctx->mac, NULL, 0, NULL) ||
+      !EVP_MAC_update(ctx->mac, data, len) ||
+      !EVP_MAC_final(ctx->mac, md, &md_len, sizeof(md)))
+    return -1;
+  memcpy(tag, md, AES_ROUTE_TAG_LENGTH);
+  return 0;
+}
+
+int aes_ctx_route_verify(aes_ctx_t *ctx, const uint8_t *data, size_t len,
+                         const uint8_t tag[AES_ROUTE_TAG_LENGTH]) {
+  uint8_t expected[AES_ROUTE_TAG_LENGTH];
+  if (aes_ctx_route_tag(ctx, data, len, expected) < 0)
+    return 0;
+  return CRYPTO_memcmp(expected, tag, AES_ROUTE_TAG_LENGTH) == 0;
+}
+
+// Two halves: gathered input blocks and cipher output blocks
+static uint8_t *reserve_scratch(aes_ctx_t *ctx, size_t blocks) {
+  size_t need = blocks * AES_BLOCK_SIZE * 2;
+  if (need > ctx->scratch_cap) {
+    uint8_t *scratch = realloc(ctx->scratch, need);
+    if (!scratch)
+      return NULL;
+    ctx->scratch = scratch;
+    ctx->scratch_cap = need;
+  }
+  return ctx->scratch;
+}
+
+// Marks every frame of a batch that could not be run as failed
+static size_t fail_batch(struct aes_frame *frames, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    frames[i].out_len = -1;
+  return 0;
+}
+
+static void xor_block(uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+  for (int i = 0; i < AES_BLOCK_SIZE; i++)
+    dst[i] = a[i] ^ b[i];
+}
+
+size_t aes_ctx_encrypt_batch(aes_ctx_t *ctx, struct aes_frame *frames,
+                             size_t count) {
+  size_t max_blocks = 0;
+  for (size_t i = 0; i < count; i++) {
+    // PKCS#7 always adds a block when the input is block aligned
+    size_t blocks = frames[i].in_len / AES_BLOCK_SIZE + 1;
+    frames[i].out_len = blocks * AES_BLOCK_SIZE;
+    if (blocks > max_blocks)
+      max_blocks = blocks;
+  }
+  uint8_t *in = reserve_scratch(ctx, count);
+  if (!in)
+    return fail_batch(frames, count);
+  uint8_t *out = in + count * AES_BLOCK_SIZE;
+
+  /* CBC encryption is serial within a frame, so each round encrypts block
+     `round` of every frame that is still that long */
+  for (size_t round = 0; round < max_blocks; round++) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+      struct aes_frame *f = &frames[i];
+      size_t offset = round * AES_BLOCK_SIZE;
+      if (offset >= (size_t)f->out_len)
+        continue;
+
+      uint8_t block[AES_BLOCK_SIZE];
+      size_t avail = f->in_len > offset ? f->in_len - offset : 0;
+      if (avail >= AES_BLOCK_SIZE) {
+        memcpy(block, f->in + offset, AES_BLOCK_SIZE);
+      } else {
+        memcpy(block, f->in + offset, avail);
+        memset(block + avail, AES_BLOCK_SIZE - avail, AES_BLOCK_SIZE - avail);
+      }
+      const uint8_t *chain = round ? f->out + offset - AES_BLOCK_SIZE : f->iv;
+      xor_block(in + n * AES_BLOCK_SIZE, block, chain);
+      n++;
+    }
+
+    int len;
+    if (!EVP_EncryptUpdate(ctx->ecb_enc, out, &len, in, n * AES_BLOCK_SIZE))
+      return fail_batch(frames, count);
+
+    n = 0;
+    for (size_t i = 0; i < count; i++) {
+      size_t offset = round * AES_BLOCK_SIZE;
+      if (offset >= (size_t)frames[i].out_len)
+        continue;
+      memcpy(frames[i].out + offset, out + n * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+      n++;
+    }
+  }
+  return count;
+}
+
+size_t aes_ctx_decrypt_batch(aes_ctx_t *ctx, struct aes_frame *frames,
+                             size_t count) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (frames[i].in_len == 0 || frames[i].in_len % AES_BLOCK_SIZE) {
+      frames[i].out_len = -1;
+      continue;
+    }
+    frames[i].out_len = 0;
+    total += frames[i].in_len / AES_BLOCK_SIZE;
+  }
+  if (total == 0)
+    return 0;
+  uint8_t *in = reserve_scratch(ctx, total);
+  if (!in)
+    return fail_batch(frames, count);
+  uint8_t *out = in + total * AES_BLOCK_SIZE;
+
+  // CBC decryption has no serial dependency: one pass over every block
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (frames[i].out_len < 0)
+      continue;
+    memcpy(in + offset, frames[i].in, frames[i].in_len);
+    offset += frames[i].in_len;
+  }
+  int len;
+  if (!EVP_DecryptUpdate(ctx->ecb_dec, out, &len, in, offset))
+    return fail_batch(frames, count);
+
+  size_t done = 0;
+  offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct aes_frame *f = &frames[i];
+    if (f->out_len < 0)
+      continue;
+
+    size_t blocks = f->in_len / AES_BLOCK_SIZE;
+    uint8_t last[AES_BLOCK_SIZE];
+    for (size_t b = 0; b < blocks; b++) {
+      const uint8_t *chain = b ? f->in + (b - 1) * AES_BLOCK_SIZE : f->iv;
+      uint8_t *dst = b + 1 < blocks ? f->out + b * AES_BLOCK_SIZE : last;
+      xor_block(dst, out + offset + b * AES_BLOCK_SIZE, chain);
+    }
+    offset += f->in_len;
+
+    // Strip PKCS#7 padding from the final block
+    int pad = last[AES_BLOCK_SIZE - 1];
+    int bad = pad == 0 || pad > AES_BLOCK_SIZE;
+    for (int b = 0; !bad && b < pad; b++)
+      bad = last[AES_BLOCK_SIZE - 1 - b] != pad;
+    if (bad) {
+      f->out_len = -1;
+      continue;
+    }
+    memcpy(f->out + (blocks - 1) * AES_BLOCK_SIZE, last, AES_BLOCK_SIZE - pad);
+    f->out_len = f->in_len - pad;
+    done++;
+  }
+  OPENSSL_cleanse(out, total * AES_BLOCK_SIZE);
+  return done;
+}
+
+static void free_thread_cache(void *data) {
+  struct aes_thread_cache *cache = data;
+  for (int i = 0; i < AES_THREAD_CACHE_SIZE; i++)
+    aes_ctx_free(cache->ctx[i]);
+  free(cache);
+}
+
+static void create_cache_key(void) {
+  pthread_key_create(&cache_key, free_thread_cache);
+}
+
+aes_ctx_t *aes_thread_ctx(const uint8_t *key) {
+  pthread_once(&cache_once, create_cache_key);
+  struct aes_thread_cache *cache = pthread_getspecific(cache_key);
+  if (!cache) {
+    cache = calloc(1, sizeof(*cache));
+    if (!cache || pthread_setspecific(cache_key, cache)) {
+      free(cache);
+      return NULL;
+    }
+  }
+
+  for (int i = 0; i < AES_THREAD_CACHE_SIZE; i++) {
+    if (cache->ctx[i] &&
+        memcmp(cache->ctx[i]->key, key, AES_KEY_LENGTH_BYTE) == 0)
+      return cache->ctx[i];
+  }
+
+  aes_ctx_t *ctx = aes_ctx_new(key);
+  if (!ctx)
+    return NULL;
+  aes_ctx_free(cache->ctx[cache->next]);
+  cache->ctx[cache->next] = ctx;
+  cache->next = (cache->next + 1) % AES_THREAD_CACHE_SIZE;
+  return ctx;
+}
@@ -9,10 +9,69 @@
 #define AES_KEY_LENGTH_BYTE 32
 #define AES_IV_LENGTH_BYTE 16
 #define AES_MSG_SIZE 128
+#define AES_THREAD_CACHE_SIZE 4
+#define AES_BLOCK_SIZE 16
+#define AES_ROUTE_TAG_LENGTH 8
+#define AES_ROUTE_KEY_INFO "route tag" // HKDF info of the route tag key
 
 void encryptAES(const uint8_t *input, size_t input_len, const uint8_t *key,
                 const uint8_t *iv, uint8_t *output);
 
 void decryptAES(const uint8_t *ciphertext, size_t ciphertext_len,
                 const uint8_t *key, const uint8_t *iv, uint8_t *output);
+
+/* Pre-keyed cipher context. The key schedule is expanded once in
+   aes_ctx_new(); every encrypt/decrypt only loads a new IV. Output is
+   identical to encryptAES()/decryptAES(). A context must not be shared
+   between threads. */
+typedef struct aes_ctx aes_ctx_t;
+
+aes_ctx_t *aes_ctx_new(const uint8_t *key);
+
+void aes_ctx_free(aes_ctx_t *ctx);
+
+// Returns the number of bytes written to output or -1 on error
+int aes_ctx_encrypt(aes_ctx_t *ctx, const uint8_t *input, size_t input_len,
+                    const uint8_t *iv, uint8_t *output);
+
+int aes_ctx_decrypt(aes_ctx_t *ctx, const uint8_t *ciphertext,
+                    size_t ciphertext_len, const uint8_t *iv, uint8_t *output);
+
+/* One message of a batch. in/out must not overlap. For decryption out
+   needs room for in_len bytes. out_len is set by the batch call, -1 if the
+   frame could not be processed (bad length or padding, or the whole batch
+   failed). */
+struct aes_frame {
+  const uint8_t *iv;
+  const uint8_t *in;
+  size_t in_len;
+  uint8_t *out;
+  int out_len;
+};
+
+/* Batch variants of aes_ctx_encrypt()/aes_ctx_decrypt() over independent
+   frames, each with its own IV. Blocks of all frames are pushed through a
+   single ECB call per CBC round (decryption needs just one) so the cipher
+   pipeline stays full across frames. Output matches the per-frame calls.
+   Return the number of frames processed successfully. */
+size_t aes_ctx_encrypt_batch(aes_ctx_t *ctx, struct aes_frame *frames,
+                             size_t count);
+
+size_t aes_ctx_decrypt_batch(aes_ctx_t *ctx, struct aes_frame *frames,
+                             size_t count);
+
+/* Truncated HMAC-SHA256 authenticating cleartext routing data. Its key is
+   derived from the context key with HKDF-SHA256 and AES_ROUTE_KEY_INFO, so
+   the cipher key is never used as a MAC key; it is set up once per
+   context. */
+int aes_ctx_route_tag(aes_ctx_t *ctx, const uint8_t *data, size_t len,
+                      uint8_t tag[AES_ROUTE_TAG_LENGTH]);
+
+// Returns 1 if tag matches data, 0 otherwise. Constant time
+int aes_ctx_route_verify(aes_ctx_t *ctx, const uint8_t *data, size_t len,
+                         const uint8_t tag[AES_ROUTE_TAG_LENGTH]);
+
+/* Context for key owned by the calling thread's cache. Freed when the
+   thread exits; the caller must not free it. */
+aes_ctx_t *aes_thread_ctx(const uint8_t *key);
 #endif
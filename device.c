@@ -1,206 +1,342 @@
+/*
+
+Motor controller firmware. Everything runs on one thread around an epoll
+loop: timerfds for the Msg A period, the motor cut-off, the relay pulses
+and the contact debounce, the server socket and the motor state edge
+events. Msg A samples taken while the server is unreachable are spooled
+and uploaded in one batch once it is back.
+
+By default a Msg A is only sent when a reading moved: an ADC channel past
+the deadband since the last report, the GPIO byte or the remaining cut-off
+minutes. A heartbeat is sent when nothing changed for heartbeat_s, so the
+server's liveness timeout has to be above it. -r fixed sends every
+MSG_A_PERIOD_S like older firmware. -r packed samples every MSG_A_PERIOD_S
+too, but sends batch_size samples at a time in one bit-packed Msg A2.
+
+*/
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <gpiod.h>
 #include <netinet/in.h>
-#include <pthread.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "aes/aes.h"
 #include "common.h"
+#include "event_loop/event_loop.h"
+#include "framing.h"
+#include "hal.h"
+#include "relay.h"
 #include "server.h"
-#include "spi_device/spi.h"
+#include "spool.h"
+#include "telemetry.h"
 #include "timer.h"
 
-#define CONSUMER "Motor controller"
 #define SERVER_IP "192.168.193.106"
 #define DEVICE_ID 1
 
 #define STARTER_BUTTON_TIMER 200
 #define MSG_A_PERIOD_S 10
+#define REPORT_CHECK_MS 1000 // Readings are compared this often
+#define HEARTBEAT_S 50       // Below the server's default 60 s timeout
+#define ADC_DEADBAND 8       // Counts of the 10-bit ADC
+#define BATCH_SAMPLES 5      // Per Msg A2, one every 50 s
 #define USB_POWER_RESET_TIME 5
-#define GPIO_CHIP_0 "gpiochip0"
-#define GPIO_CHIP_1 "gpiochip1"
-#define GPIO_CHIP_2 "gpiochip2"
-#define VAL0_PIN 15
-#define VAL1_PIN 18
-#define NC_PIN 0
-#define NO_PIN 1
-#define MOTOR_STATE_PIN 16
+#define NETWORK_ATTACH_TIME 30 // Given to the modem after a power reset
 #define MAX_CONN_ERR 3
-#define USB_POWER_PIN 26
+#define CONNECT_TIMEOUT_S 10
+// Reconnect delays double from the minimum up to the maximum
+#define BACKOFF_MIN_MS 1000
+#define BACKOFF_MAX_MS 300000
+#define MODEM_RESET_FAILURES 4 // Failed connects in a row before a reset
+// Motor state edges closer together than this are reported once
+#define MOTOR_DEBOUNCE_MS 20
+
+enum report_mode { REPORT_FIXED, REPORT_ADAPTIVE, REPORT_PACKED };
 
+struct event_loop *loop;
 int client_socket = -1;
+bool connecting; // client_socket waits for a non-blocking connect
+struct frame_ring rx;
 timer_w_t motor_cutoff_timer;
 timer_w_t msg_A_timer;
-int conn_err_cnt = MAX_CONN_ERR;
-
-struct gpiod_chip *chip2;
-struct gpiod_line *valve0;
-struct gpiod_line *valve1;
-struct gpiod_line *nc;
-struct gpiod_line *no;
-struct gpiod_line *motor_state;
-struct gpiod_chip *chip1;
-struct gpiod_line *usb_power;
-
-enum pin_dir { INPUT, OUTPUT };
+timer_w_t debounce_timer;
+timer_w_t connect_timer; // Connect timeout, backoff and modem reset
+struct relay_pulser relay;
+bool modem_off;
+int conn_err_cnt = 0;
+int connect_failures = 0;
+int reported_motor_state = -1;
+const char *server_ip = SERVER_IP;
+const char *spool_path;
+struct spool spool;
+enum report_mode report_mode = REPORT_ADAPTIVE;
+int heartbeat_s = HEARTBEAT_S;
+int adc_deadband = ADC_DEADBAND;
+// Last Msg A sent or spooled, what adaptive reporting compares against
+uint8_t last_report[MSG_SIZE];
+time_t last_report_time = -1; // CLOCK_MONOTONIC seconds
+int batch_size = BATCH_SAMPLES;
+// Packed reporting: samples not sent yet, the last one taken at batch_time
+struct msg_A2_fields batch;
+time_t batch_time;
+time_t batch_sent_time; // CLOCK_MONOTONIC seconds
+
+#define UPLOAD_FRAME_SIZE                                                      \
+  (FRAME_HEADER_SIZE + MSG_A1_HEADER_SIZE +                                    \
+   MSG_A1_MAX_SAMPLES * MSG_A1_SAMPLE_SIZE)
+
+// Spooled records up to end, framed as A1s and written as one batch
+struct {
+  uint8_t data[(SPOOL_CAPACITY / MSG_A1_MAX_SAMPLES + 1) * UPLOAD_FRAME_SIZE];
+  size_t len; // 0 when no upload is in flight
+  size_t sent;
+  uint32_t end;
+} upload;
 
 int get_rssi(void) { return -33; }
 
-int make_connection();
+void connect_server(void);
 
-int assign_pin(struct gpiod_chip *chip, struct gpiod_line **line, int pin,
-               enum pin_dir dir) {
-  if (!chip) {
-    return -1;
-  }
+void retry_later(void);
 
-  *line = gpiod_chip_get_line(chip, pin);
-  if (!(*line)) {
-    return -1;
-  }
+uint8_t gen_GPIO_state_byte(void) {
+  int lines[HAL_LINES];
+  if (hal_get_lines(lines) < 0)
+    return 0;
 
-  int ret = 0;
-  if (dir == OUTPUT)
-    ret = gpiod_line_request_output(*line, CONSUMER, 0);
-  else
-    ret = gpiod_line_request_input(*line, CONSUMER);
+  uint8_t byte =
+      ((lines[HAL_MOTOR_STATE] << 4) | (lines[HAL_VALVE1] << 3) |
+       (lines[HAL_VALVE0] << 2) | (lines[HAL_NC] << 1) | lines[HAL_NO]) &
+      0xFF;
 
-  return ret;
+  return byte;
 }
 
-int gpio_init() {
-  {
-    char *chipname = GPIO_CHIP_2;
-    chip2 = gpiod_chip_open_by_name(chipname);
-    if (!chip2) {
-      printf("Open chip failed\n");
-      return -1;
-    }
-  }
-
-  int ret = 0;
-  ret = assign_pin(chip2, &valve0, VAL0_PIN, OUTPUT);
-  ret |= assign_pin(chip2, &valve1, VAL1_PIN, OUTPUT);
-  ret |= assign_pin(chip2, &nc, NC_PIN, OUTPUT);
-  ret |= assign_pin(chip2, &no, NO_PIN, OUTPUT);
-  ret |= assign_pin(chip2, &motor_state, MOTOR_STATE_PIN, INPUT);
-
-  {
-    char *chipname = GPIO_CHIP_1;
-    chip1 = gpiod_chip_open_by_name(chipname);
-    if (!chip1) {
-      printf("Open chip failed\n");
-      return -1;
-    }
-  }
-
-  ret |= assign_pin(chip1, &usb_power, USB_POWER_PIN, OUTPUT);
-  gpiod_line_set_value(usb_power, 1);
-
-  return ret;
+void gen_msg_A(uint8_t buffer[MSG_SIZE]) {
+  struct msg_A_fields fields;
+  fields.passcode = PASSCODE_LO | PASSCODE_HI << 8;
+  fields.device_id = DEVICE_ID;
+  fields.rssi = get_rssi();
+  if (hal_read_adc(fields.adc) < 0)
+    memset(fields.adc, 0, sizeof(fields.adc));
+  fields.rem_cut_off_time = get_timer_state(&motor_cutoff_timer);
+  fields.gpio = gen_GPIO_state_byte();
+  msg_A_pack(buffer, &fields);
 }
 
-void hard_reset_modem(void) {
-  printf("Resetting USB power.\n");
-  gpiod_line_set_value(usb_power, 0);
-  usleep(USB_POWER_RESET_TIME * 1000 * 1000);
-  gpiod_line_set_value(usb_power, 1);
+time_t monotonic_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
 }
 
-uint8_t gen_GPIO_state_byte(void) {
-  int val0_state = gpiod_line_get_value(valve0);
-  int val1_state = gpiod_line_get_value(valve1);
-  int nc_state = gpiod_line_get_value(nc);
-  int no_state = gpiod_line_get_value(no);
-  int motor_state_val = gpiod_line_get_value(motor_state);
-
-  uint8_t byte = ((motor_state_val << 4) | (val1_state << 3) |
-                  (val0_state << 2) | (nc_state << 1) | no_state) &
-                 0xFF;
+/* Sends one payload, framed at its exact length. Returns -1 if it was not
+   sent, to be spooled by the caller. */
+int send_payload(const uint8_t *payload, size_t len) {
+  // Sent after the upload, so the server gets the samples in order
+  if (client_socket < 0 || connecting || upload.len > 0)
+    return -1;
 
-  return byte;
+  uint8_t frame[FRAME_HEADER_SIZE + MSG_A2_MAX_SIZE]; // Largest payload
+  int frame_len = frame_encode(frame, payload, len);
+  int sent_bytes = send(client_socket, frame, frame_len, MSG_NOSIGNAL);
+  if (sent_bytes == frame_len) {
+    conn_err_cnt = 0;
+    return 0;
+  }
+  printf("Error. Sent %d out of %d bytes\n", sent_bytes, frame_len);
+  // A partial frame leaves the stream unusable
+  if (sent_bytes > 0 || ++conn_err_cnt >= MAX_CONN_ERR)
+    retry_later();
+  return -1;
 }
 
-void gen_msg_A(uint8_t buffer[MSG_SIZE]) {
-  buffer[0] = MSG_TYPE_A;
-  buffer[1] = PASSCODE_LO;
-  buffer[2] = PASSCODE_HI;
-  buffer[3] = DEVICE_ID;
-  buffer[4] = get_rssi();
-
-  uint16_t adc0 = get_raw_voltage(0);
-  uint16_t adc1 = get_raw_voltage(1);
-  uint16_t adc2 = get_raw_voltage(2);
-  uint16_t adc3 = get_raw_voltage(3);
-
-  buffer[5] = adc0 & 0xFF;       // 8 bits
-  buffer[6] = (adc0 >> 8) & 0x3; // MSB 2 bits
-
-  buffer[7] = adc1 & 0xFF;       // 8 bits
-  buffer[8] = (adc1 >> 8) & 0x3; // MSB 2 bits
+void report_msg_A(const uint8_t message[MSG_SIZE]) {
+  memcpy(last_report, message, MSG_SIZE);
+  last_report_time = monotonic_s();
+  if (send_payload(message, MSG_SIZE) < 0)
+    spool_push(&spool, time(NULL), message);
+}
 
-  buffer[9] = adc2 & 0xFF;        // 8 bits
-  buffer[10] = (adc2 >> 8) & 0x3; // MSB 2 bits
+// Sends the batch as one Msg A2, or spools its samples while offline
+void send_batch(void) {
+  if (batch.count == 0)
+    return;
+  time_t now = time(NULL);
+  batch.interval = MSG_A_PERIOD_S;
+  batch.age = now - batch_time < 255 ? now - batch_time : 255;
+  batch_sent_time = monotonic_s();
+  uint8_t payload[MSG_A2_MAX_SIZE];
+  int len = msg_A2_pack(payload, &batch);
+  if (send_payload(payload, len) < 0) {
+    struct msg_A_fields fields = {batch.passcode, batch.device_id, batch.rssi,
+                                  {0}, batch.rem_cut_off_time, batch.gpio};
+    for (int i = 0; i < batch.count; i++) {
+      uint8_t message[MSG_SIZE];
+      memcpy(fields.adc, batch.adc[i], sizeof(fields.adc));
+      msg_A_pack(message, &fields);
+      spool_push(&spool, batch_time - (batch.count - 1 - i) * MSG_A_PERIOD_S,
+                 message);
+    }
+  }
+  batch.count = 0;
+}
 
-  buffer[11] = adc3 & 0xFF;       // 8 bits
-  buffer[12] = (adc3 >> 8) & 0x3; // MSB 2 bits
+/* Adds the readings to the batch. GPIO and cut-off minutes are per frame,
+   so a change of either goes out at once in a frame of its own. The batch
+   is also sent early when waiting for the next sample would leave the
+   server without a frame for longer than the heartbeat. */
+void batch_msg_A(const uint8_t message[MSG_SIZE]) {
+  struct msg_A_fields fields, last;
+  msg_A_unpack(message, &fields);
+  msg_A_unpack(last_report, &last);
+  bool changed = last_report_time < 0 || fields.gpio != last.gpio ||
+                 fields.rem_cut_off_time != last.rem_cut_off_time;
+  if (changed)
+    send_batch();
+  memcpy(last_report, message, MSG_SIZE);
+  last_report_time = monotonic_s();
+
+  batch.passcode = fields.passcode;
+  batch.device_id = fields.device_id;
+  batch.rssi = fields.rssi;
+  batch.rem_cut_off_time = fields.rem_cut_off_time;
+  batch.gpio = fields.gpio;
+  memcpy(batch.adc[batch.count++], fields.adc, sizeof(fields.adc));
+  batch_time = time(NULL);
+  if (changed || batch.count >= batch_size ||
+      monotonic_s() - batch_sent_time + MSG_A_PERIOD_S > heartbeat_s)
+    send_batch();
+}
 
-  int remTime = get_timer_state(&motor_cutoff_timer);
-  buffer[13] = remTime & 0xFF;
-  buffer[14] = (remTime >> 8) & 0xFF;
+// Reports the current readings right away
+void send_msg_A(void *data) {
+  uint8_t message[MSG_SIZE];
+  memset(message, 0, sizeof(message));
+  gen_msg_A(message);
+  if (report_mode == REPORT_PACKED) {
+    // Off the sampling period, so it goes in a frame of its own
+    send_batch();
+    batch_msg_A(message);
+    send_batch();
+    return;
+  }
+  report_msg_A(message);
+}
 
-  buffer[15] = gen_GPIO_state_byte();
+// Whether message differs enough from the last report to be sent
+bool msg_A_changed(const uint8_t message[MSG_SIZE]) {
+  struct msg_A_fields now, last;
+  msg_A_unpack(message, &now);
+  msg_A_unpack(last_report, &last);
+  if (now.gpio != last.gpio || now.rem_cut_off_time != last.rem_cut_off_time)
+    return true;
+  for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++) {
+    if (abs(now.adc[ch] - last.adc[ch]) > adc_deadband)
+      return true;
+  }
+  return false;
 }
 
-void send_msg_A(union sigval sv) {
+void on_report_timer(void *data) {
+  if (report_mode == REPORT_FIXED) {
+    send_msg_A(NULL);
+    return;
+  }
   uint8_t message[MSG_SIZE];
   memset(message, 0, sizeof(message));
   gen_msg_A(message);
-  int sent_bytes = send(client_socket, message, sizeof(message), 0);
-  if (sent_bytes != MSG_SIZE) {
-    printf("Error. Sent %d out of %d bytes\n", sent_bytes, MSG_SIZE);
-    conn_err_cnt++;
-    if (conn_err_cnt >= MAX_CONN_ERR) {
-      // try reconnecting
-      close(client_socket);
-      stop_timer(&msg_A_timer);
-      client_socket = make_connection();
-      start_timer(MSG_A_PERIOD_S, MSG_A_PERIOD_S, send_msg_A, &msg_A_timer, -1);
-      conn_err_cnt = 0;
-    }
-  } else {
-    conn_err_cnt = 0;
+  if (report_mode == REPORT_PACKED) {
+    batch_msg_A(message);
+    return;
   }
+  if (last_report_time < 0 || msg_A_changed(message) ||
+      monotonic_s() - last_report_time >= heartbeat_s)
+    report_msg_A(message);
 }
 
-void start_motor() {
-  printf("Starting motor\n");
-  gpiod_line_set_value(no, 1);
-  usleep(STARTER_BUTTON_TIMER * 1000);
-  gpiod_line_set_value(no, 0);
+/* Writes what the socket takes, the rest once it is writable again.
+   Returns -1 if the connection was dropped. */
+int continue_upload(void) {
+  while (upload.sent < upload.len) {
+    ssize_t n = send(client_socket, upload.data + upload.sent,
+                     upload.len - upload.sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return event_loop_modify(loop, client_socket, EVENT_READ | EVENT_WRITE);
+    if (n < 0) {
+      perror("Error uploading spooled samples");
+      retry_later();
+      return -1;
+    }
+    upload.sent += n;
+  }
+  spool_release(&spool, upload.end);
+  upload.len = 0;
+  event_loop_modify(loop, client_socket, EVENT_READ);
+  return 0;
 }
 
-void stop_motor() {
-  printf("Stopping motor\n");
-  gpiod_line_set_value(nc, 1);
-  usleep(STARTER_BUTTON_TIMER * 1000);
-  gpiod_line_set_value(nc, 0);
+// Uploads every spooled record, oldest first, as A1 frames in one send
+int start_upload(void) {
+  uint32_t count = spool_count(&spool);
+  if (count == 0)
+    return 0;
+  uint32_t first = spool.header->tail;
+  uint32_t now = time(NULL);
+  upload.len = 0;
+  upload.sent = 0;
+  for (uint32_t i = 0; i < count; i += MSG_A1_MAX_SAMPLES) {
+    uint8_t payload[UPLOAD_FRAME_SIZE];
+    int len = 0;
+    for (uint32_t j = i; j < count && j < i + MSG_A1_MAX_SAMPLES; j++) {
+      const struct spool_record *record = spool_get(&spool, first + j);
+      if (j == i)
+        msg_A1_init(payload, record->msg_A);
+      len = msg_A1_add(payload, record->msg_A,
+                       record->time < now ? now - record->time : 0);
+    }
+    upload.len += frame_encode(upload.data + upload.len, payload, len);
+  }
+  upload.end = first + count;
+  printf("Uploading %u spooled samples\n", count);
+  return continue_upload();
 }
 
-void stop_motor_t(union sigval sv) {
+void start_motor() { relay_request(&relay, RELAY_START); }
+
+void stop_motor() { relay_request(&relay, RELAY_STOP); }
+
+void stop_motor_t(void *data) {
   stop_motor();
   stop_timer(&motor_cutoff_timer);
 }
 
+// Reports the motor state once the contacts stopped bouncing
+void on_debounced(void *data) {
+  int state = hal_get_line(HAL_MOTOR_STATE);
+  if (state < 0 || state == reported_motor_state)
+    return;
+  printf("Motor state changed to %s\n", state ? "off" : "on");
+  reported_motor_state = state;
+  send_msg_A(NULL);
+}
+
+void on_motor_event(struct event_loop *loop, int fd, uint32_t events,
+                    void *data) {
+  // Edge-triggered, take every pending edge
+  while (hal_read_motor_event() >= 0)
+    ;
+  start_timer_ms(MOTOR_DEBOUNCE_MS, 0, &debounce_timer);
+}
+
 void handle_msg_B(uint8_t buffer[MSG_SIZE]) {
   if (buffer[0] != MSG_TYPE_B)
     return;
@@ -217,19 +353,21 @@ void handle_msg_B(uint8_t buffer[MSG_SIZE]) {
   uint8_t val0State = (buffer[6] >> 1) & 0x1;
   uint8_t val1State = (buffer[6] >> 2) & 0x1;
 
-  // motor_state HI=OFF; LOW=ON
-  uint8_t curMotorState = gpiod_line_get_value(motor_state);
-  gpiod_line_set_value(valve0, val0State);
-  gpiod_line_set_value(valve1, val1State);
+  // motor_state HI=OFF; LOW=ON. The input lags a relay pulse in flight
+  uint8_t curMotorState = hal_get_line(HAL_MOTOR_STATE);
+  if (relay_intent(&relay) != RELAY_NONE)
+    curMotorState = relay_intent(&relay) == RELAY_STOP;
+  hal_set_line(HAL_VALVE0, val0State);
+  hal_set_line(HAL_VALVE1, val1State);
 
   int remTimeSec = remTime * 60;
 
   if (recMotorState) {
     if ((remTime > 0) && (curMotorState)) {
       start_motor();
-      start_timer(remTimeSec, 0, stop_motor_t, &motor_cutoff_timer, -1);
+      start_timer(remTimeSec, 0, &motor_cutoff_timer);
     } else if ((remTime > 0) && (!curMotorState)) { // adjust timer
-      adjust_timer(remTimeSec, 0, stop_motor_t, &motor_cutoff_timer, -1);
+      adjust_timer(remTimeSec, 0, &motor_cutoff_timer);
     }
   } else {
     if (!curMotorState) {
@@ -239,41 +377,157 @@ void handle_msg_B(uint8_t buffer[MSG_SIZE]) {
   }
 }
 
-void receive_data(void) {
-
-  while (1) {
-    // Receive data from the server
-    int8_t buffer[AES_MSG_SIZE];
-    int rec_bytes = read(client_socket, buffer, sizeof(buffer));
-
-    // Close socket if server terminates connection
-    printf("got %d bytes\n", rec_bytes);
-    if (rec_bytes < 1) {
-      usleep(10 * 1000 * 1000);
+void handle_frames(void) {
+  // Handle every complete frame; a partial one waits for the next read
+  uint8_t buffer[AES_MSG_SIZE];
+  int len;
+  while ((len = frame_ring_next(&rx, buffer, sizeof(buffer))) > 0) {
+    if (len < AES_IV_LENGTH_BYTE + MSG_SIZE + MSG_SIZE)
       continue;
-    }
 
     // Decrypt recieved message
     uint8_t iv[AES_IV_LENGTH_BYTE];
     memcpy(iv, buffer, AES_IV_LENGTH_BYTE);
     uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
-    uint8_t decData[MSG_SIZE] = {0};
-    decryptAES(buffer + AES_IV_LENGTH_BYTE, MSG_SIZE + MSG_SIZE, key, iv,
-               decData);
+    uint8_t decData[MSG_SIZE + MSG_SIZE] = {0};
+    if (aes_ctx_decrypt(aes_thread_ctx(key), buffer + AES_IV_LENGTH_BYTE,
+                        MSG_SIZE + MSG_SIZE, iv, decData) < 0)
+      continue;
 
     // Process message
     handle_msg_B(decData);
   }
+  if (len < 0) {
+    printf("Corrupt frame from server\n");
+    frame_ring_init(&rx);
+  }
+}
+
+void on_server_data(struct event_loop *loop, int fd, uint32_t events,
+                    void *data) {
+  if ((events & EVENT_WRITE) && upload.len > 0) {
+    if (continue_upload() < 0)
+      return;
+    // Samples spooled while the last batch was going out
+    if (upload.len == 0 && start_upload() < 0)
+      return;
+  }
+
+  while (1) {
+    // Receive data from the server
+    ssize_t rec_bytes = frame_ring_fill(&rx, client_socket);
+    if (rec_bytes < 0 && errno == EINTR)
+      continue;
+    if (rec_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+
+    // Reconnect if server terminates connection
+    if (rec_bytes < 1) {
+      printf("Connection with server lost\n");
+      retry_later();
+      return;
+    }
+    printf("got %zd bytes\n", rec_bytes);
+    handle_frames();
+  }
 }
 
-int make_connection() {
-  int soc;
+void on_connected(void) {
+  connecting = false;
+  conn_err_cnt = 0;
+  connect_failures = 0;
+  stop_timer(&connect_timer);
+  frame_ring_init(&rx); // Partial frames died with the last connection
+  event_loop_remove(loop, client_socket);
+  if (event_loop_add(loop, client_socket, EVENT_READ, on_server_data, NULL) <
+      0) {
+    retry_later();
+    return;
+  }
+  printf("connection with server etablished on soc %d\n", client_socket);
+  // Catch up on the outage, then register with the server right away
+  // instead of at the next period
+  if (start_upload() < 0)
+    return;
+  send_msg_A(NULL);
+}
+
+// Full doubling delay, jittered to between half and all of it so devices
+// cut off together do not come back in lockstep
+long backoff_ms(int failures) {
+  long delay = BACKOFF_MAX_MS;
+  if (failures < 20 && (BACKOFF_MIN_MS << (failures - 1)) < BACKOFF_MAX_MS)
+    delay = BACKOFF_MIN_MS << (failures - 1);
+  return delay / 2 + random() % (delay / 2 + 1);
+}
+
+/* Drops the connection and schedules the next attempt. After
+   MODEM_RESET_FAILURES failures in a row the modem may be the problem:
+   reset it, then give it time to attach. */
+void retry_later(void) {
+  if (client_socket > -1) {
+    event_loop_remove(loop, client_socket);
+    close(client_socket);
+    client_socket = -1;
+  }
+  connecting = false;
+  upload.len = 0; // The records stay spooled for the next connection
+
+  if (++connect_failures % MODEM_RESET_FAILURES == 0) {
+    printf("Resetting USB power.\n");
+    hal_set_line(HAL_USB_POWER, 0);
+    modem_off = true;
+    start_timer(USB_POWER_RESET_TIME, 0, &connect_timer);
+    return;
+  }
+  long delay = backoff_ms(connect_failures);
+  printf("Reconnecting in %ld ms\n", delay);
+  start_timer_ms(delay, 0, &connect_timer);
+}
+
+void connect_failed(void) {
+  perror("Error connecting to server");
+  retry_later();
+}
+
+void on_connect_timer(void *data) {
+  if (modem_off) {
+    hal_set_line(HAL_USB_POWER, 1);
+    modem_off = false;
+    start_timer(NETWORK_ATTACH_TIME, 0, &connect_timer);
+    return;
+  }
+  if (connecting) {
+    errno = ETIMEDOUT;
+    connect_failed();
+    return;
+  }
+  connect_server();
+}
+
+void on_connect_event(struct event_loop *loop, int fd, uint32_t events,
+                      void *data) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+    errno = err;
+    connect_failed();
+    return;
+  }
+  on_connected();
+}
+
+// Starts a non-blocking connect, completed from the event loop
+void connect_server(void) {
   struct sockaddr_in server_address;
 
   // Create a socket
-  soc = socket(AF_INET, SOCK_STREAM, 0);
-  if (soc == -1) {
+  client_socket =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (client_socket == -1) {
     perror("Error creating socket");
+    connect_failed();
+    return;
   }
 
   // Set up the server address structure
@@ -281,47 +535,134 @@ int make_connection() {
   server_address.sin_port =
       htons(SERVER_PORT); // Change this port number as needed
   server_address.sin_addr.s_addr =
-      inet_addr(SERVER_IP); // Replace with the server's IP address or domain
+      inet_addr(server_ip); // Replace with the server's IP address or domain
 
-  // Connect to the server
-  while (1) {
-    if (connect(soc, (struct sockaddr *)&server_address,
-                sizeof(server_address)) == -1) {
-      perror("Error connecting to server");
-      // maybe problem with modem. reset it
-      hard_reset_modem();
-      // give 30s to connect to network
-      usleep(30 * 1000 * 1000);
-    } else {
-      printf("connection with server etablished on soc %d\n", soc);
+  connecting = true;
+  int ret = connect(client_socket, (struct sockaddr *)&server_address,
+                    sizeof(server_address));
+  if (ret < 0 && errno != EINPROGRESS) {
+    connect_failed();
+    return;
+  }
+  if (event_loop_add(loop, client_socket, EVENT_WRITE, on_connect_event,
+                     NULL) < 0) {
+    connect_failed();
+    return;
+  }
+  if (ret == 0)
+    on_connected();
+  else
+    start_timer(CONNECT_TIMEOUT_S, 0, &connect_timer);
+}
+
+// microbench links this file to time gen_msg_A on the simulated board
+#ifndef DEVICE_NO_MAIN
+void usage(const char *prog) {
+  printf("Usage: %s [-H gpiod|sim] [-a server ip] [-s spool file] "
+         "[-r adaptive|fixed|packed] [-t heartbeat seconds] [-d ADC deadband] "
+         "[-n samples per Msg A2]\n",
+         prog);
+}
+
+int main(int argc, char *argv[]) {
+  enum hal_backend backend = HAL_BACKEND_GPIOD;
+  int opt;
+  while ((opt = getopt(argc, argv, "H:a:s:r:t:d:n:h")) != -1) {
+    switch (opt) {
+    case 'H':
+      if (hal_backend_parse(optarg, &backend) < 0) {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'a':
+      server_ip = optarg;
+      break;
+    case 's':
+      spool_path = optarg;
+      break;
+    case 'r':
+      if (strcmp(optarg, "adaptive") == 0) {
+        report_mode = REPORT_ADAPTIVE;
+      } else if (strcmp(optarg, "fixed") == 0) {
+        report_mode = REPORT_FIXED;
+      } else if (strcmp(optarg, "packed") == 0) {
+        report_mode = REPORT_PACKED;
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 't':
+      heartbeat_s = atoi(optarg);
+      if (heartbeat_s < 1) {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'd':
+      adc_deadband = atoi(optarg);
+      if (adc_deadband < 0) {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'n':
+      batch_size = atoi(optarg);
+      if (batch_size < 1 || batch_size > MSG_A2_MAX_SAMPLES) {
+        printf("Samples per Msg A2 must be between 1 and %d\n",
+               MSG_A2_MAX_SAMPLES);
+        return -1;
+      }
       break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : -1;
     }
   }
-  return soc;
-}
 
-int main() {
-  msg_A_timer.isValid = false;
-  motor_cutoff_timer.isValid = false;
-  // Initialize GPIO
-  if (gpio_init() < 0) {
-    printf("Error in gpio init\n");
+  // Initialize GPIO and ADC
+  if (hal_init(backend) < 0) {
+    printf("Error initializing %s hardware\n", hal_backend_name(backend));
     return -1;
   }
 
-  // Initialize SPI
-  if (spi_init() < 0) {
-    printf("Error initializing SPI0\n");
+  if (spool_open(&spool, spool_path) < 0)
+    return -1;
+  srandom(time(NULL) ^ getpid() ^ DEVICE_ID << 16);
+
+  loop = event_loop_create(EVENT_BACKEND_EPOLL);
+  if (!loop ||
+      timer_init(&msg_A_timer, loop, on_report_timer, NULL) < 0 ||
+      timer_init(&motor_cutoff_timer, loop, stop_motor_t, NULL) < 0 ||
+      timer_init(&debounce_timer, loop, on_debounced, NULL) < 0 ||
+      timer_init(&connect_timer, loop, on_connect_timer, NULL) < 0 ||
+      relay_init(&relay, loop, STARTER_BUTTON_TIMER) < 0) {
+    printf("Could not create the event loop\n");
     return -1;
   }
 
-  // Send MSG A periodically
-  start_timer(MSG_A_PERIOD_S, MSG_A_PERIOD_S, send_msg_A, &msg_A_timer, -1);
+  int motor_fd = hal_motor_event_fd();
+  if (motor_fd > -1) {
+    fcntl(motor_fd, F_SETFL, fcntl(motor_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (event_loop_add(loop, motor_fd, EVENT_READ, on_motor_event, NULL) < 0)
+      return -1;
+  }
+  reported_motor_state = hal_get_line(HAL_MOTOR_STATE);
+
+  connect_server();
 
-  receive_data();
+  // Send MSG A periodically, or check whether one is due
+  if (report_mode != REPORT_ADAPTIVE)
+    start_timer(MSG_A_PERIOD_S, MSG_A_PERIOD_S, &msg_A_timer);
+  else
+    start_timer_ms(REPORT_CHECK_MS, REPORT_CHECK_MS, &msg_A_timer);
 
-  // Close the socket
-  close(client_socket);
+  while (1) {
+    if (event_loop_run_once(loop, -1) < 0 && errno != EINTR)
+      perror("Event loop error");
+  }
 
   return 0;
 }
+#endif
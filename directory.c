@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "directory.h"
+
+static uint32_t hash_id(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id;
+}
+
+static struct directory_entry *probe(struct directory_entry *slots,
+                                     size_t capacity, uint32_t id) {
+  size_t mask = capacity - 1;
+  size_t i = hash_id(id) & mask;
+  while (slots[i].used && slots[i].id != id)
+    i = (i + 1) & mask;
+  return &slots[i];
+}
+
+static int grow(struct device_directory *dir) {
+  size_t capacity = dir->capacity * 2;
+  struct directory_entry *slots = calloc(capacity, sizeof(*slots));
+  if (!slots)
+    return -1;
+  for (size_t i = 0; i < dir->capacity; i++)
+    if (dir->slots[i].used)
+      *probe(slots, capacity, dir->slots[i].id) = dir->slots[i];
+  free(dir->slots);
+  dir->slots = slots;
+  dir->capacity = capacity;
+  return 0;
+}
+
+int directory_init(struct device_directory *dir, size_t capacity) {
+  memset(dir, 0, sizeof(*dir));
+  dir->capacity = 64;
+  while (dir->capacity < capacity)
+    dir->capacity *= 2;
+  dir->slots = calloc(dir->capacity, sizeof(*dir->slots));
+  if (!dir->slots)
+    return -1;
+  return pthread_rwlock_init(&dir->lock, NULL) ? -1 : 0;
+}
+
+void directory_free(struct device_directory *dir) {
+  for (size_t i = 0; i < dir->capacity; i++)
+    history_free(dir->slots[i].history);
+  pthread_rwlock_destroy(&dir->lock);
+  free(dir->slots);
+  memset(dir, 0, sizeof(*dir));
+}
+
+int directory_owner(struct device_directory *dir, uint32_t id) {
+  pthread_rwlock_rdlock(&dir->lock);
+  struct directory_entry *entry = probe(dir->slots, dir->capacity, id);
+  int owner = entry->used ? entry->owner : -1;
+  pthread_rwlock_unlock(&dir->lock);
+  return owner;
+}
+
+// Finds or inserts the entry for id. Caller holds the write lock
+static struct directory_entry *upsert(struct device_directory *dir,
+                                      uint32_t id) {
+  struct directory_entry *entry = probe(dir->slots, dir->capacity, id);
+  if (entry->used)
+    return entry;
+  if (dir->count + 1 > dir->capacity / 2) {
+    if (grow(dir) < 0)
+      return NULL;
+    entry = probe(dir->slots, dir->capacity, id);
+  }
+  entry->used = 1;
+  entry->id = id;
+  entry->owner = -1;
+  dir->count++;
+  return entry;
+}
+
+void directory_set_online(struct device_directory *dir, uint32_t id,
+                          int owner) {
+  pthread_rwlock_wrlock(&dir->lock);
+  struct directory_entry *entry = upsert(dir, id);
+  if (entry)
+    entry->owner = owner;
+  pthread_rwlock_unlock(&dir->lock);
+}
+
+void directory_set_offline(struct device_directory *dir, uint32_t id,
+                           int owner) {
+  pthread_rwlock_wrlock(&dir->lock);
+  struct directory_entry *entry = probe(dir->slots, dir->capacity, id);
+  if (entry->used && entry->owner == owner)
+    entry->owner = -1;
+  pthread_rwlock_unlock(&dir->lock);
+}
+
+struct telemetry_history *directory_history(struct device_directory *dir,
+                                            uint32_t id) {
+  struct telemetry_history *history = directory_find_history(dir, id);
+  if (history)
+    return history;
+
+  pthread_rwlock_wrlock(&dir->lock);
+  struct directory_entry *entry = upsert(dir, id);
+  if (entry && !entry->history)
+    entry->history = history_new();
+  history = entry ? entry->history : NULL;
+  pthread_rwlock_unlock(&dir->lock);
+  return history;
+}
+
+struct telemetry_history *directory_find_history(struct device_directory *dir,
+                                                 uint32_t id) {
+  pthread_rwlock_rdlock(&dir->lock);
+  struct directory_entry *entry = probe(dir->slots, dir->capacity, id);
+  struct telemetry_history *history = entry->used ? entry->history : NULL;
+  pthread_rwlock_unlock(&dir->lock);
+  return history;
+}
+
+int directory_list_online(struct device_directory *dir, uint32_t *ids,
+                          int max) {
+  int n = 0;
+  pthread_rwlock_rdlock(&dir->lock);
+  for (size_t i = 0; i < dir->capacity && n < max; i++)
+    if (dir->slots[i].used && dir->slots[i].owner > -1)
+      ids[n++] = dir->slots[i].id;
+  pthread_rwlock_unlock(&dir->lock);
+  return n;
+}
@@ -0,0 +1,53 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+
+/* Process-wide map from device id to the worker whose registry shard holds
+   the device's live connection, and to the device's telemetry history. The
+   owner is only consulted when several workers run. Written when a device
+   comes online or goes offline, not per message. */
+struct directory_entry {
+  uint32_t id;
+  int owner; // Worker index, -1 while offline
+  int used;
+  struct telemetry_history *history; // Kept for the process lifetime
+};
+
+struct device_directory {
+  pthread_rwlock_t lock;
+  struct directory_entry *slots;
+  size_t capacity; // Power of two
+  size_t count;
+};
+
+int directory_init(struct device_directory *dir, size_t capacity);
+
+void directory_free(struct device_directory *dir);
+
+// Owning worker of an online device, -1 if unknown or offline
+int directory_owner(struct device_directory *dir, uint32_t id);
+
+void directory_set_online(struct device_directory *dir, uint32_t id,
+                          int owner);
+
+// Ignored if another worker has taken the device over meanwhile
+void directory_set_offline(struct device_directory *dir, uint32_t id,
+                           int owner);
+
+// History of the device, created on first use. NULL if out of memory
+struct telemetry_history *directory_history(struct device_directory *dir,
+                                            uint32_t id);
+
+// History of the device, NULL if it never reported
+struct telemetry_history *directory_find_history(struct device_directory *dir,
+                                                 uint32_t id);
+
+// Copies up to max ids of online devices, returns how many
+int directory_list_online(struct device_directory *dir, uint32_t *ids,
+                          int max);
+
+#endif
@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <event_loop.h>
+
+#define EPOLL_BATCH 256
+
+struct event_watch {
+  event_handler_t handler;
+  void *data;
+  uint32_t events;
+};
+
+struct event_loop {
+  enum event_backend backend;
+  int epoll_fd;
+  int max_fd;
+  /* Indexed by fd. A NULL entry means the fd is not watched. */
+  struct event_watch **watches;
+  int watches_cap;
+};
+
+static int reserve_watch(struct event_loop *loop, int fd) {
+  if (fd < loop->watches_cap)
+    return 0;
+
+  int cap = loop->watches_cap ? loop->watches_cap : 64;
+  while (cap <= fd)
+    cap *= 2;
+  struct event_watch **watches =
+      realloc(loop->watches, sizeof(*watches) * cap);
+  if (!watches)
+    return -1;
+  memset(watches + loop->watches_cap, 0,
+         sizeof(*watches) * (cap - loop->watches_cap));
+  loop->watches = watches;
+  loop->watches_cap = cap;
+  return 0;
+}
+
+static uint32_t to_epoll_events(uint32_t events) {
+  uint32_t ep = EPOLLET | EPOLLRDHUP;
+  if (events & EVENT_READ)
+    ep |= EPOLLIN;
+  if (events & EVENT_WRITE)
+    ep |= EPOLLOUT;
+  return ep;
+}
+
+struct event_loop *event_loop_create(enum event_backend backend) {
+  struct event_loop *loop = calloc(1, sizeof(*loop));
+  if (!loop)
+    return NULL;
+
+  loop->backend = backend;
+  loop->epoll_fd = -1;
+  loop->max_fd = -1;
+  if (backend == EVENT_BACKEND_EPOLL) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+      perror("epoll_create1 failed");
+      free(loop);
+      return NULL;
+    }
+  }
+  return loop;
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+  if (!loop)
+    return;
+  for (int fd = 0; fd < loop->watches_cap; fd++)
+    free(loop->watches[fd]);
+  free(loop->watches);
+  if (loop->epoll_fd > -1)
+    close(loop->epoll_fd);
+  free(loop);
+}
+
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events,
+                   event_handler_t handler, void *data) {
+  if (fd < 0)
+    return -1;
+  if (loop->backend == EVENT_BACKEND_SELECT && fd >= FD_SETSIZE) {
+    printf("fd %d exceeds FD_SETSIZE, use the epoll backend\n", fd);
+    return -1;
+  }
+  if (reserve_watch(loop, fd) < 0 || loop->watches[fd])
+    return -1;
+
+  struct event_watch *watch = malloc(sizeof(*watch));
+  if (!watch)
+    return -1;
+  watch->handler = handler;
+  watch->data = data;
+  watch->events = events;
+
+  if (loop->backend == EVENT_BACKEND_EPOLL) {
+    struct epoll_event ev = {.events = to_epoll_events(events), .data.fd = fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl add failed");
+      free(watch);
+      return -1;
+    }
+  }
+
+  loop->watches[fd] = watch;
+  if (fd > loop->max_fd)
+    loop->max_fd = fd;
+  return 0;
+}
+
+int event_loop_modify(struct event_loop *loop, int fd, uint32_t events) {
+  if (fd < 0 || fd >= loop->watches_cap || !loop->watches[fd])
+    return -1;
+
+  if (loop->backend == EVENT_BACKEND_EPOLL) {
+    struct epoll_event ev = {.events = to_epoll_events(events), .data.fd = fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+      perror("epoll_ctl mod failed");
+      return -1;
+    }
+  }
+  loop->watches[fd]->events = events;
+  return 0;
+}
+
+int event_loop_remove(struct event_loop *loop, int fd) {
+  if (fd < 0 || fd >= loop->watches_cap || !loop->watches[fd])
+    return -1;
+
+  if (loop->backend == EVENT_BACKEND_EPOLL)
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+  free(loop->watches[fd]);
+  loop->watches[fd] = NULL;
+  while (loop->max_fd > -1 && !loop->watches[loop->max_fd])
+    loop->max_fd--;
+  return 0;
+}
+
+/* Handlers may remove or add fds while a batch is dispatched, so every event
+   is resolved through the fd table rather than a cached pointer. */
+static void dispatch(struct event_loop *loop, int fd, uint32_t events) {
+  if (fd >= loop->watches_cap || !loop->watches[fd])
+    return;
+  struct event_watch *watch = loop->watches[fd];
+  watch->handler(loop, fd, events, watch->data);
+}
+
+static int run_epoll(struct event_loop *loop, int timeout_ms) {
+  struct epoll_event events[EPOLL_BATCH];
+  int n = epoll_wait(loop->epoll_fd, events, EPOLL_BATCH, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t ev = 0;
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+      ev |= EVENT_READ;
+    if (events[i].events & EPOLLOUT)
+      ev |= EVENT_WRITE;
+    if (events[i].events & EPOLLERR)
+      ev |= EVENT_ERROR | EVENT_READ;
+    dispatch(loop, events[i].data.fd, ev);
+  }
+  return n;
+}
+
+static int run_select(struct event_loop *loop, int timeout_ms) {
+  fd_set read_fds, write_fds;
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+
+  int max_fd = loop->max_fd;
+  for (int fd = 0; fd <= max_fd; fd++) {
+    struct event_watch *watch = loop->watches[fd];
+    if (!watch)
+      continue;
+    if (watch->events & EVENT_READ)
+      FD_SET(fd, &read_fds);
+    if (watch->events & EVENT_WRITE)
+      FD_SET(fd, &write_fds);
+  }
+
+  struct timeval tv;
+  struct timeval *tvp = NULL;
+  if (timeout_ms >= 0) {
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  int n = select(max_fd + 1, &read_fds, &write_fds, NULL, tvp);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  int dispatched = 0;
+  for (int fd = 0; fd <= max_fd && dispatched < n; fd++) {
+    uint32_t ev = 0;
+    if (FD_ISSET(fd, &read_fds))
+      ev |= EVENT_READ;
+    if (FD_ISSET(fd, &write_fds))
+      ev |= EVENT_WRITE;
+    if (ev) {
+      dispatch(loop, fd, ev);
+      dispatched++;
+    }
+  }
+  return dispatched;
+}
+
+int event_loop_run_once(struct event_loop *loop, int timeout_ms) {
+  if (loop->backend == EVENT_BACKEND_EPOLL)
+    return run_epoll(loop, timeout_ms);
+  return run_select(loop, timeout_ms);
+}
+
+int event_backend_parse(const char *name, enum event_backend *backend) {
+  if (strcmp(name, "epoll") == 0)
+    *backend = EVENT_BACKEND_EPOLL;
+  else if (strcmp(name, "select") == 0)
+    *backend = EVENT_BACKEND_SELECT;
+  else
+    return -1;
+  return 0;
+}
+
+const char *event_backend_name(enum event_backend backend) {
+  return backend == EVENT_BACKEND_EPOLL ? "epoll" : "select";
+}
@@ -0,0 +1,37 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+#include <stdint.h>
+
+#define EVENT_READ 0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4
+
+enum event_backend { EVENT_BACKEND_EPOLL, EVENT_BACKEND_SELECT };
+
+struct event_loop;
+
+/* Called once per wakeup for a ready fd. The epoll backend is edge-triggered,
+   so handlers must drain the fd until EAGAIN. */
+typedef void (*event_handler_t)(struct event_loop *loop, int fd,
+                                uint32_t events, void *data);
+
+struct event_loop *event_loop_create(enum event_backend backend);
+
+void event_loop_destroy(struct event_loop *loop);
+
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events,
+                   event_handler_t handler, void *data);
+
+int event_loop_modify(struct event_loop *loop, int fd, uint32_t events);
+
+int event_loop_remove(struct event_loop *loop, int fd);
+
+/* Wait up to timeout_ms (-1 blocks) and dispatch ready fds. Returns the
+   number of dispatched events or -1 on error. */
+int event_loop_run_once(struct event_loop *loop, int timeout_ms);
+
+int event_backend_parse(const char *name, enum event_backend *backend);
+
+const char *event_backend_name(enum event_backend backend);
+
+#endif
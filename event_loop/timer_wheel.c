@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <timer_wheel.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static void arm(struct timer_wheel *wheel, bool on) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (on) {
+    its.it_value.tv_sec = wheel->tick_ms / 1000;
+    its.it_value.tv_nsec = (wheel->tick_ms % 1000) * 1000000L;
+    its.it_interval = its.it_value;
+  }
+  timerfd_settime(wheel->timer_fd, 0, &its, NULL);
+}
+
+static void link_timer(struct timer_wheel *wheel, struct wheel_timer *timer) {
+  uint64_t delta = timer->expires - wheel->now;
+  if (timer->expires < wheel->now) {
+    timer->expires = wheel->now;
+    delta = 0;
+  } else if (delta > WHEEL_MAX_DELTA) {
+    timer->expires = wheel->now + WHEEL_MAX_DELTA;
+    delta = WHEEL_MAX_DELTA;
+  }
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    level++;
+  struct wheel_timer **slot =
+      &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) &
+                           WHEEL_MASK];
+
+  timer->next = *slot;
+  if (*slot)
+    (*slot)->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void unlink_timer(struct wheel_timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// Re-inserts every timer of a higher level slot; they land on lower levels
+static int cascade(struct timer_wheel *wheel, int level) {
+  int index = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  struct wheel_timer *timer = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+  while (timer) {
+    struct wheel_timer *next = timer->next;
+    link_timer(wheel, timer);
+    timer = next;
+  }
+  return index;
+}
+
+static void run_tick(struct timer_wheel *wheel) {
+  int index = wheel->now & WHEEL_MASK;
+  if (index == 0) {
+    for (int level = 1; level < WHEEL_LEVELS; level++)
+      if (cascade(wheel, level) != 0)
+        break;
+  }
+
+  // Detach the slot so callbacks can freely reschedule or cancel timers
+  struct wheel_timer *expired = wheel->slots[0][index];
+  wheel->slots[0][index] = NULL;
+  if (expired)
+    expired->pprev = &expired;
+  wheel->now++;
+
+  while (expired) {
+    struct wheel_timer *timer = expired;
+    unlink_timer(timer);
+    wheel->pending--;
+    timer->callback(timer, timer->data);
+  }
+}
+
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->tick_ms = tick_ms ? tick_ms : 1;
+  wheel->timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wheel->timer_fd < 0) {
+    perror("timerfd_create failed");
+    return -1;
+  }
+  return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel) {
+  if (wheel->timer_fd > -1)
+    close(wheel->timer_fd);
+  wheel->timer_fd = -1;
+}
+
+int timer_wheel_fd(const struct timer_wheel *wheel) { return wheel->timer_fd; }
+
+void timer_wheel_process(struct timer_wheel *wheel) {
+  uint64_t ticks;
+  if (read(wheel->timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+    return;
+
+  while (ticks-- > 0 && wheel->pending > 0)
+    run_tick(wheel);
+
+  if (wheel->pending == 0)
+    arm(wheel, false);
+}
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_callback_t callback,
+                      void *data) {
+  memset(timer, 0, sizeof(*timer));
+  timer->callback = callback;
+  timer->data = data;
+}
+
+void timer_wheel_schedule(struct timer_wheel *wheel, struct wheel_timer *timer,
+                          uint64_t delay_ms) {
+  if (timer->pprev)
+    unlink_timer(timer);
+  else if (wheel->pending++ == 0)
+    arm(wheel, true);
+
+  uint64_t ticks = (delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  timer->expires = wheel->now + (ticks ? ticks - 1 : 0);
+  link_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer) {
+  if (!timer->pprev)
+    return;
+  unlink_timer(timer);
+  wheel->pending--;
+}
+
+bool wheel_timer_pending(const struct wheel_timer *timer) {
+  return timer->pprev != NULL;
+}
+
+uint64_t timer_wheel_remaining_ms(const struct timer_wheel *wheel,
+                                  const struct wheel_timer *timer) {
+  if (!timer->pprev)
+    return 0;
+  return (timer->expires - wheel->now + 1) * wheel->tick_ms;
+}
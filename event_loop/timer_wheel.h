@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer;
+
+typedef void (*wheel_callback_t)(struct wheel_timer *timer, void *data);
+
+/* Intrusive timer node. Embed it in the object that owns the timeout;
+   scheduling and cancelling only relink it, nothing is allocated. */
+struct wheel_timer {
+  struct wheel_timer *next;
+  struct wheel_timer **pprev; // NULL when not scheduled
+  uint64_t expires;           // Absolute tick
+  wheel_callback_t callback;
+  void *data;
+};
+
+/* Hierarchical timing wheel driven by a single timerfd. Level 0 holds
+   timers due within WHEEL_SLOTS ticks, each further level covers
+   WHEEL_SLOTS times the range of the one below and is cascaded down as the
+   wheel turns. Callbacks run on the thread that calls
+   timer_wheel_process(). */
+struct timer_wheel {
+  int timer_fd;
+  unsigned int tick_ms;
+  uint64_t now; // Next tick to process
+  size_t pending;
+  struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+int timer_wheel_init(struct timer_wheel *wheel, unsigned int tick_ms);
+
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+// fd to watch for EVENT_READ; call timer_wheel_process() when it fires
+int timer_wheel_fd(const struct timer_wheel *wheel);
+
+void timer_wheel_process(struct timer_wheel *wheel);
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_callback_t callback,
+                      void *data);
+
+// Schedules or reschedules the timer; O(1)
+void timer_wheel_schedule(struct timer_wheel *wheel, struct wheel_timer *timer,
+                          uint64_t delay_ms);
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+bool wheel_timer_pending(const struct wheel_timer *timer);
+
+uint64_t timer_wheel_remaining_ms(const struct timer_wheel *wheel,
+                                  const struct wheel_timer *timer);
+
+#endif
@@ -0,0 +1,73 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "framing.h"
+
+#define FRAME_RING_MASK (FRAME_RING_SIZE - 1)
+
+static void copy_out(const struct frame_ring *ring, uint32_t offset,
+                     uint8_t *out, size_t len) {
+  uint32_t start = (ring->head + offset) & FRAME_RING_MASK;
+  size_t first = FRAME_RING_SIZE - start;
+  if (first > len)
+    first = len;
+  memcpy(out, ring->data + start, first);
+  memcpy(out + first, ring->data, len - first);
+}
+
+void frame_ring_init(struct frame_ring *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+size_t frame_ring_used(const struct frame_ring *ring) {
+  return ring->tail - ring->head;
+}
+
+ssize_t frame_ring_fill(struct frame_ring *ring, int fd) {
+  size_t free_space = FRAME_RING_SIZE - frame_ring_used(ring);
+  if (free_space == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  uint32_t start = ring->tail & FRAME_RING_MASK;
+  size_t first = FRAME_RING_SIZE - start;
+  if (first > free_space)
+    first = free_space;
+  struct iovec iov[2] = {{ring->data + start, first},
+                         {ring->data, free_space - first}};
+
+  ssize_t n = readv(fd, iov, free_space > first ? 2 : 1);
+  if (n > 0)
+    ring->tail += n;
+  return n;
+}
+
+int frame_ring_next(struct frame_ring *ring, uint8_t *payload, size_t cap) {
+  size_t used = frame_ring_used(ring);
+  if (used < FRAME_HEADER_SIZE)
+    return 0;
+
+  uint8_t header[FRAME_HEADER_SIZE];
+  copy_out(ring, 0, header, FRAME_HEADER_SIZE);
+  size_t len = header[1] | (header[2] << 8);
+  if (header[0] != FRAME_MAGIC || len == 0 || len > FRAME_MAX_PAYLOAD ||
+      len > cap)
+    return -1;
+  if (used < FRAME_HEADER_SIZE + len)
+    return 0;
+
+  copy_out(ring, FRAME_HEADER_SIZE, payload, len);
+  ring->head += FRAME_HEADER_SIZE + len;
+  return len;
+}
+
+size_t frame_encode(uint8_t *out, const uint8_t *payload, size_t len) {
+  out[0] = FRAME_MAGIC;
+  out[1] = len & 0xFF;
+  out[2] = (len >> 8) & 0xFF;
+  memcpy(out + FRAME_HEADER_SIZE, payload, len);
+  return len + FRAME_HEADER_SIZE;
+}
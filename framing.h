@@ -0,0 +1,40 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes/aes.h"
+
+/* Stream framing: every message is sent as
+     [FRAME_MAGIC][payload length, 2 bytes little endian][payload]
+   Legacy peers start with a message type byte, which is never FRAME_MAGIC,
+   so the first byte of a connection tells the two apart. */
+#define FRAME_MAGIC 0xFE
+#define FRAME_HEADER_SIZE 3
+#define FRAME_MAX_PAYLOAD AES_MSG_SIZE // The server reads into one message
+#define FRAME_RING_SIZE 2048 // Power of two, holds at least one full frame
+
+// Reassembly buffer for one connection. head/tail are free-running
+struct frame_ring {
+  uint32_t head;
+  uint32_t tail;
+  uint8_t data[FRAME_RING_SIZE];
+};
+
+void frame_ring_init(struct frame_ring *ring);
+
+size_t frame_ring_used(const struct frame_ring *ring);
+
+/* Reads from fd into all free space of the ring with one readv. Returns
+   the read() result; -1 with errno ENOBUFS if the ring is full. */
+ssize_t frame_ring_fill(struct frame_ring *ring, int fd);
+
+/* Moves the next complete frame's payload into payload. Returns its length,
+   0 if no complete frame is buffered yet, -1 if the stream is corrupt. */
+int frame_ring_next(struct frame_ring *ring, uint8_t *payload, size_t cap);
+
+// Writes header and payload to out, which needs len + FRAME_HEADER_SIZE
+size_t frame_encode(uint8_t *out, const uint8_t *payload, size_t len);
+
+#endif
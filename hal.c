@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hal.h"
+
+static const struct hal_ops *hal;
+
+int hal_init(enum hal_backend backend) {
+  switch (backend) {
+  case HAL_BACKEND_GPIOD:
+#ifdef HAVE_GPIOD
+    hal = &hal_gpiod_ops;
+    break;
+#else
+    printf("Built without libgpiod, only the sim backend is available\n");
+    return -1;
+#endif
+  case HAL_BACKEND_SIM:
+    hal = &hal_sim_ops;
+    break;
+  }
+  return hal->init();
+}
+
+int hal_get_line(enum hal_line line) { return hal->get_line(line); }
+
+int hal_set_line(enum hal_line line, int value) {
+  return hal->set_line(line, value);
+}
+
+int hal_get_lines(int values[HAL_LINES]) { return hal->get_lines(values); }
+
+int hal_motor_event_fd(void) { return hal->motor_event_fd(); }
+
+int hal_read_motor_event(void) { return hal->read_motor_event(); }
+
+int hal_read_adc(uint16_t values[HAL_ADC_CHANNELS]) {
+  return hal->read_adc(values);
+}
+
+int hal_backend_parse(const char *name, enum hal_backend *backend) {
+  if (strcmp(name, "gpiod") == 0)
+    *backend = HAL_BACKEND_GPIOD;
+  else if (strcmp(name, "sim") == 0)
+    *backend = HAL_BACKEND_SIM;
+  else
+    return -1;
+  return 0;
+}
+
+const char *hal_backend_name(enum hal_backend backend) {
+  return backend == HAL_BACKEND_SIM ? "sim" : "gpiod";
+}
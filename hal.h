@@ -0,0 +1,58 @@
+#ifndef HAL_H
+#define HAL_H
+#include <stdint.h>
+
+#define HAL_ADC_CHANNELS 4
+
+enum hal_line {
+  HAL_VALVE0,
+  HAL_VALVE1,
+  HAL_NC,          // Stop button relay, normally closed contact
+  HAL_NO,          // Start button relay, normally open contact
+  HAL_MOTOR_STATE, // Input, HI=OFF; LOW=ON
+  HAL_USB_POWER,   // Modem power
+  HAL_LINES
+};
+
+enum hal_backend { HAL_BACKEND_GPIOD, HAL_BACKEND_SIM };
+
+// One backend's implementation of the calls below
+struct hal_ops {
+  int (*init)(void);
+  int (*get_line)(enum hal_line line);
+  int (*set_line)(enum hal_line line, int value);
+  int (*read_adc)(uint16_t values[HAL_ADC_CHANNELS]);
+  int (*get_lines)(int values[HAL_LINES]);
+  int (*motor_event_fd)(void);
+  int (*read_motor_event)(void);
+};
+
+extern const struct hal_ops hal_gpiod_ops; // Only when built with libgpiod
+extern const struct hal_ops hal_sim_ops;
+
+// Opens the lines and the ADC. Returns -1 if they are not available
+int hal_init(enum hal_backend backend);
+
+int hal_get_line(enum hal_line line);
+
+int hal_set_line(enum hal_line line, int value);
+
+/* Every line at once: outputs as last set, inputs read together in one
+   request */
+int hal_get_lines(int values[HAL_LINES]);
+
+// Readable whenever HAL_MOTOR_STATE changes, -1 without edge detection
+int hal_motor_event_fd(void);
+
+/* Takes one edge off the event fd and returns the motor state after it,
+   -1 on error */
+int hal_read_motor_event(void);
+
+// Raw 10-bit conversions of every channel
+int hal_read_adc(uint16_t values[HAL_ADC_CHANNELS]);
+
+int hal_backend_parse(const char *name, enum hal_backend *backend);
+
+const char *hal_backend_name(enum hal_backend backend);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+
+Board backend: GPIO lines through libgpiod, ADC over spidev.
+
+*/
+
+#include <gpiod.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hal.h"
+#include "spi_device/spi.h"
+
+#define CONSUMER "Motor controller"
+#define GPIO_CHIP_1 "gpiochip1"
+#define GPIO_CHIP_2 "gpiochip2"
+#define VAL0_PIN 15
+#define VAL1_PIN 18
+#define NC_PIN 0
+#define NO_PIN 1
+#define MOTOR_STATE_PIN 16
+#define USB_POWER_PIN 26
+// Background ADC sampling period, 0 converts the channels on every read
+#define ADC_SAMPLE_PERIOD_MS 0
+
+// Inputs with EDGES also report both edges on their event fd
+enum pin_dir { INPUT, OUTPUT, EDGES };
+
+struct pin {
+  const char *chip;
+  int offset;
+  enum pin_dir dir;
+};
+
+static const struct pin pins[HAL_LINES] = {
+    [HAL_VALVE0] = {GPIO_CHIP_2, VAL0_PIN, OUTPUT},
+    [HAL_VALVE1] = {GPIO_CHIP_2, VAL1_PIN, OUTPUT},
+    [HAL_NC] = {GPIO_CHIP_2, NC_PIN, OUTPUT},
+    [HAL_NO] = {GPIO_CHIP_2, NO_PIN, OUTPUT},
+    [HAL_MOTOR_STATE] = {GPIO_CHIP_2, MOTOR_STATE_PIN, EDGES},
+    [HAL_USB_POWER] = {GPIO_CHIP_1, USB_POWER_PIN, OUTPUT},
+};
+
+static struct gpiod_chip *chip1;
+static struct gpiod_chip *chip2;
+static struct gpiod_line *lines[HAL_LINES];
+// Outputs as last set. They cannot share a request with the inputs
+static int output_values[HAL_LINES];
+static struct gpiod_line_bulk inputs;
+
+static int assign_pin(enum hal_line line) {
+  struct gpiod_chip *chip =
+      strcmp(pins[line].chip, GPIO_CHIP_1) == 0 ? chip1 : chip2;
+  lines[line] = gpiod_chip_get_line(chip, pins[line].offset);
+  if (!lines[line])
+    return -1;
+
+  if (pins[line].dir == OUTPUT)
+    return gpiod_line_request_output(lines[line], CONSUMER, 0);
+  gpiod_line_bulk_add(&inputs, lines[line]);
+  if (pins[line].dir == EDGES)
+    return gpiod_line_request_both_edges_events(lines[line], CONSUMER);
+  return gpiod_line_request_input(lines[line], CONSUMER);
+}
+
+static int board_init(void) {
+  chip1 = gpiod_chip_open_by_name(GPIO_CHIP_1);
+  chip2 = gpiod_chip_open_by_name(GPIO_CHIP_2);
+  if (!chip1 || !chip2) {
+    printf("Open chip failed\n");
+    return -1;
+  }
+
+  int ret = 0;
+  gpiod_line_bulk_init(&inputs);
+  for (int line = 0; line < HAL_LINES; line++)
+    ret |= assign_pin(line);
+  if (ret)
+    return -1;
+  gpiod_line_set_value(lines[HAL_USB_POWER], 1);
+  output_values[HAL_USB_POWER] = 1;
+
+  if (spi_init() < 0) {
+    printf("Error initializing SPI0\n");
+    return -1;
+  }
+  if (ADC_SAMPLE_PERIOD_MS &&
+      spi_sampler_start(ADC_SAMPLE_PERIOD_MS * 1000) < 0)
+    return -1;
+  return 0;
+}
+
+static int board_get_line(enum hal_line line) {
+  return gpiod_line_get_value(lines[line]);
+}
+
+static int board_set_line(enum hal_line line, int value) {
+  if (gpiod_line_set_value(lines[line], value) < 0)
+    return -1;
+  output_values[line] = value;
+  return 0;
+}
+
+static int board_get_lines(int values[HAL_LINES]) {
+  int input_values[HAL_LINES];
+  if (gpiod_line_get_value_bulk(&inputs, input_values) < 0)
+    return -1;
+  for (int line = 0, in = 0; line < HAL_LINES; line++)
+    values[line] =
+        pins[line].dir == OUTPUT ? output_values[line] : input_values[in++];
+  return 0;
+}
+
+static int board_motor_event_fd(void) {
+  return gpiod_line_event_get_fd(lines[HAL_MOTOR_STATE]);
+}
+
+static int board_read_motor_event(void) {
+  struct gpiod_line_event event;
+  if (gpiod_line_event_read(lines[HAL_MOTOR_STATE], &event) < 0)
+    return -1;
+  return event.event_type == GPIOD_LINE_EVENT_RISING_EDGE;
+}
+
+static int board_read_adc(uint16_t values[HAL_ADC_CHANNELS]) {
+  struct spi_sample sample;
+  if (ADC_SAMPLE_PERIOD_MS && spi_sampler_latest(&sample) == 0) {
+    memcpy(values, sample.adc, sizeof(sample.adc));
+    return 0;
+  }
+  return spi_read_all(values);
+}
+
+const struct hal_ops hal_gpiod_ops = {
+    board_init,     board_get_line,       board_set_line,
+    board_read_adc, board_get_lines,      board_motor_event_fd,
+    board_read_motor_event};
@@ -0,0 +1,224 @@
+/*
+
+In-process stand-in for the board, so the firmware runs on any Linux host.
+
+ADC channels follow scripted waveforms, set with HAL_SIM_ADC as one
+shape:low:high:period_s entry per channel, comma separated, shape being
+const, sine, square or ramp. The motor state input follows the relays like
+the contactor does: a NO pulse of at least SIM_PULSE_MIN_MS starts the
+motor, an NC pulse stops it. With HAL_SIM_TRIP_S set, a running motor
+trips by itself after that many seconds. Every change of the motor state is
+reported on an eventfd, like the edge events of the board's GPIO.
+
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hal.h"
+
+#define SIM_PULSE_MIN_MS 100
+#define SIM_ADC_MAX 1023
+
+enum sim_shape { SIM_CONST, SIM_SINE, SIM_SQUARE, SIM_RAMP };
+
+struct sim_waveform {
+  enum sim_shape shape;
+  int low;
+  int high;
+  double period_s;
+};
+
+static struct sim_waveform waveforms[HAL_ADC_CHANNELS] = {
+    {SIM_SINE, 400, 600, 60},
+    {SIM_RAMP, 0, SIM_ADC_MAX, 120},
+    {SIM_SQUARE, 100, 900, 30},
+    {SIM_CONST, 512, 512, 0},
+};
+
+// Lines are set from the receive loop and read from timer threads
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t motor_changed;
+static int event_fd = -1;
+static int lines[HAL_LINES];
+static double pulse_start[HAL_LINES];
+static double motor_started;
+static double trip_after_s;
+static double start_time;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Called with sim_lock held
+static void set_motor_state(int value) {
+  if (lines[HAL_MOTOR_STATE] == value)
+    return;
+  lines[HAL_MOTOR_STATE] = value;
+  if (!value)
+    motor_started = now_sec();
+  uint64_t edge = 1;
+  if (write(event_fd, &edge, sizeof(edge)) < 0)
+    perror("Could not signal motor edge");
+  pthread_cond_broadcast(&motor_changed);
+}
+
+// Trips the motor HAL_SIM_TRIP_S after each start
+static void *trip_run(void *arg) {
+  pthread_mutex_lock(&sim_lock);
+  while (1) {
+    while (lines[HAL_MOTOR_STATE])
+      pthread_cond_wait(&motor_changed, &sim_lock);
+    double started = motor_started;
+    double at = started + trip_after_s;
+    struct timespec deadline = {(time_t)at, (long)((at - (time_t)at) * 1e9)};
+    while (!lines[HAL_MOTOR_STATE] && motor_started == started &&
+           pthread_cond_timedwait(&motor_changed, &sim_lock, &deadline) == 0)
+      ;
+    if (!lines[HAL_MOTOR_STATE] && motor_started == started) {
+      printf("Simulated motor tripped\n");
+      set_motor_state(1);
+    }
+  }
+  return NULL;
+}
+
+static int parse_waveforms(const char *script) {
+  const char *names[] = {"const", "sine", "square", "ramp"};
+  char copy[256];
+  snprintf(copy, sizeof(copy), "%s", script);
+
+  char *save;
+  char *entry = strtok_r(copy, ",", &save);
+  for (int ch = 0; ch < HAL_ADC_CHANNELS && entry; ch++) {
+    char shape[16];
+    struct sim_waveform w = {0};
+    if (sscanf(entry, "%15[a-z]:%d:%d:%lf", shape, &w.low, &w.high,
+               &w.period_s) < 3)
+      return -1;
+    int found = 0;
+    for (int s = 0; s < 4; s++) {
+      if (strcmp(shape, names[s]) == 0) {
+        w.shape = s;
+        found = 1;
+      }
+    }
+    if (!found || (w.shape != SIM_CONST && w.period_s <= 0))
+      return -1;
+    waveforms[ch] = w;
+    entry = strtok_r(NULL, ",", &save);
+  }
+  return 0;
+}
+
+static int sim_init(void) {
+  const char *script = getenv("HAL_SIM_ADC");
+  if (script && parse_waveforms(script) < 0) {
+    printf("Could not parse HAL_SIM_ADC \"%s\"\n", script);
+    return -1;
+  }
+  const char *trip = getenv("HAL_SIM_TRIP_S");
+  if (trip)
+    trip_after_s = atof(trip);
+
+  start_time = now_sec();
+  lines[HAL_MOTOR_STATE] = 1;
+  lines[HAL_USB_POWER] = 1;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&motor_changed, &attr);
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    perror("Could not create the motor event fd");
+    return -1;
+  }
+  pthread_t thread;
+  if (trip_after_s > 0 && pthread_create(&thread, NULL, trip_run, NULL)) {
+    printf("Could not start the trip simulation\n");
+    return -1;
+  }
+  printf("Simulated board, motor off\n");
+  return 0;
+}
+
+static int sim_get_line(enum hal_line line) {
+  pthread_mutex_lock(&sim_lock);
+  int value = lines[line];
+  pthread_mutex_unlock(&sim_lock);
+  return value;
+}
+
+static int sim_set_line(enum hal_line line, int value) {
+  if (line == HAL_MOTOR_STATE)
+    return -1;
+  pthread_mutex_lock(&sim_lock);
+  double now = now_sec();
+  if (value && !lines[line])
+    pulse_start[line] = now;
+  // The contactor moves when a long enough pulse ends
+  if (!value && lines[line] &&
+      now - pulse_start[line] >= SIM_PULSE_MIN_MS / 1000.0) {
+    if (line == HAL_NO)
+      set_motor_state(0);
+    else if (line == HAL_NC)
+      set_motor_state(1);
+  }
+  lines[line] = value;
+  pthread_mutex_unlock(&sim_lock);
+  return 0;
+}
+
+static int sim_get_lines(int values[HAL_LINES]) {
+  pthread_mutex_lock(&sim_lock);
+  memcpy(values, lines, sizeof(lines));
+  pthread_mutex_unlock(&sim_lock);
+  return 0;
+}
+
+static int sim_motor_event_fd(void) { return event_fd; }
+
+static int sim_read_motor_event(void) {
+  uint64_t edges;
+  if (read(event_fd, &edges, sizeof(edges)) < 0)
+    return -1;
+  return sim_get_line(HAL_MOTOR_STATE);
+}
+
+static int sim_read_adc(uint16_t values[HAL_ADC_CHANNELS]) {
+  double t = now_sec() - start_time;
+  for (int ch = 0; ch < HAL_ADC_CHANNELS; ch++) {
+    const struct sim_waveform *w = &waveforms[ch];
+    double phase = w->period_s > 0 ? fmod(t, w->period_s) / w->period_s : 0;
+    double level = 0; // 0 is low, 1 is high
+    switch (w->shape) {
+    case SIM_CONST:
+      break;
+    case SIM_SINE:
+      level = 0.5 + 0.5 * sin(2 * M_PI * phase);
+      break;
+    case SIM_SQUARE:
+      level = phase < 0.5;
+      break;
+    case SIM_RAMP:
+      level = phase;
+      break;
+    }
+    int value = w->low + (int)lround(level * (w->high - w->low));
+    values[ch] = value < 0 ? 0 : value > SIM_ADC_MAX ? SIM_ADC_MAX : value;
+  }
+  return 0;
+}
+
+const struct hal_ops hal_sim_ops = {
+    sim_init,      sim_get_line,       sim_set_line,        sim_read_adc,
+    sim_get_lines, sim_motor_event_fd, sim_read_motor_event};
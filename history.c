@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+#define SLOT(i) ((i) & (HISTORY_CAPACITY - 1))
+
+struct telemetry_history *history_new(void) {
+  struct telemetry_history *history = calloc(1, sizeof(*history));
+  if (!history)
+    return NULL;
+  if (pthread_mutex_init(&history->lock, NULL)) {
+    free(history);
+    return NULL;
+  }
+  return history;
+}
+
+void history_free(struct telemetry_history *history) {
+  if (!history)
+    return;
+  pthread_mutex_destroy(&history->lock);
+  free(history);
+}
+
+void history_append(struct telemetry_history *history,
+                    const struct telemetry_sample *sample) {
+  pthread_mutex_lock(&history->lock);
+  if (history->count > 0 &&
+      sample->time < history->time[SLOT(history->head - 1)]) {
+    pthread_mutex_unlock(&history->lock);
+    return;
+  }
+  uint32_t slot = SLOT(history->head);
+  history->time[slot] = sample->time;
+  for (int ch = 0; ch < HISTORY_ADC_CHANNELS; ch++)
+    history->adc[ch][slot] = sample->adc[ch];
+  history->rssi[slot] = sample->rssi;
+  history->gpio[slot] = sample->gpio;
+  history->head++;
+  if (history->count < HISTORY_CAPACITY)
+    history->count++;
+  pthread_mutex_unlock(&history->lock);
+}
+
+// Oldest sample index, counted from first, whose time is not before from
+static uint32_t lower_bound(const struct telemetry_history *history,
+                            uint32_t first, uint32_t from) {
+  uint32_t lo = 0, hi = history->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (history->time[SLOT(first + mid)] < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void emit(struct telemetry_sample *out, const int64_t adc_sum[],
+                 int64_t rssi_sum, uint32_t n) {
+  for (int ch = 0; ch < HISTORY_ADC_CHANNELS; ch++)
+    out->adc[ch] = adc_sum[ch] / n;
+  out->rssi = rssi_sum / (int64_t)n;
+}
+
+int history_query(struct telemetry_history *history, uint32_t from,
+                  uint32_t to, uint32_t resolution,
+                  struct telemetry_sample *out, int max) {
+  pthread_mutex_lock(&history->lock);
+  uint32_t first = history->head - history->count;
+  int n = -1;
+  uint32_t bucket = 0, merged = 0;
+  int64_t adc_sum[HISTORY_ADC_CHANNELS], rssi_sum = 0;
+
+  for (uint32_t i = lower_bound(history, first, from); i < history->count;
+       i++) {
+    uint32_t slot = SLOT(first + i);
+    uint32_t time = history->time[slot];
+    if (time > to)
+      break;
+    if (n < 0 || resolution == 0 || (time - from) / resolution != bucket) {
+      if (merged > 0) {
+        emit(&out[n], adc_sum, rssi_sum, merged);
+        merged = 0;
+      }
+      if (n + 1 == max)
+        break;
+      n++;
+      bucket = resolution ? (time - from) / resolution : 0;
+      out[n].time = time;
+      memset(adc_sum, 0, sizeof(adc_sum));
+      rssi_sum = 0;
+    }
+    for (int ch = 0; ch < HISTORY_ADC_CHANNELS; ch++)
+      adc_sum[ch] += history->adc[ch][slot];
+    rssi_sum += history->rssi[slot];
+    out[n].gpio = history->gpio[slot];
+    merged++;
+  }
+  if (merged > 0)
+    emit(&out[n], adc_sum, rssi_sum, merged);
+  pthread_mutex_unlock(&history->lock);
+  return n + 1;
+}
@@ -0,0 +1,46 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <pthread.h>
+#include <stdint.h>
+
+#define HISTORY_CAPACITY 512 // Power of two, over an hour of 10 s Msg A
+#define HISTORY_ADC_CHANNELS 4
+
+struct telemetry_sample {
+  uint32_t time; // Seconds since the epoch
+  uint16_t adc[HISTORY_ADC_CHANNELS];
+  int8_t rssi;
+  uint8_t gpio;
+};
+
+/* Last HISTORY_CAPACITY samples of one device. Every field has its own
+   packed array, so a range search only touches the timestamps. head is
+   free-running. Written by the worker holding the device, read by any. */
+struct telemetry_history {
+  pthread_mutex_t lock;
+  uint32_t head;
+  uint32_t count;
+  uint32_t time[HISTORY_CAPACITY];
+  uint16_t adc[HISTORY_ADC_CHANNELS][HISTORY_CAPACITY];
+  int8_t rssi[HISTORY_CAPACITY];
+  uint8_t gpio[HISTORY_CAPACITY];
+};
+
+struct telemetry_history *history_new(void);
+
+void history_free(struct telemetry_history *history);
+
+/* Overwrites the oldest sample once full. A sample older than the newest
+   one is dropped, so the ring stays in time order. */
+void history_append(struct telemetry_history *history,
+                    const struct telemetry_sample *sample);
+
+/* Copies up to max samples with from <= time <= to, oldest first. With a
+   non-zero resolution samples are merged per resolution seconds wide
+   bucket: time of the bucket's first sample, mean ADC and RSSI, last GPIO.
+   Returns the number of samples written. */
+int history_query(struct telemetry_history *history, uint32_t from,
+                  uint32_t to, uint32_t resolution,
+                  struct telemetry_sample *out, int max);
+
+#endif
@@ -0,0 +1,398 @@
+/*
+
+Load generator for the server. Opens a fleet of simulated device
+connections sending Msg A at a fixed rate and simulated clients cycling
+through C2, C1, C2, C0 against a server on localhost, all framed. Every C2
+carries a sequence number in its Msg B plaintext; the simulated device
+that receives the Msg B decrypts it and records the C2 to B round trip.
+
+Msg A device ids are one byte, so at most MAX_DEVICES devices are
+simulated; more would share ids and the server would see one device
+jumping between sockets.
+
+*/
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes/aes.h"
+#include "event_loop/event_loop.h"
+#include "event_loop/timer_wheel.h"
+#include "framing.h"
+#include "outq.h"
+#include "server.h"
+
+#define LOADGEN_TICK_MS 1
+#define SEND_TIMES_SIZE (1 << 20) // Power of two, C2s in flight tracked
+#define MSG_B_SEQ_IDX 8
+#define MAX_DEVICES 256 // One per Msg A device id
+
+struct sim_conn {
+  int fd;
+  bool device;
+  uint8_t device_id;
+  uint64_t requests; // Client only, picks the next request type
+  bool want_write;
+  struct outq out;
+  struct wheel_timer timer;
+  struct frame_ring rx;
+};
+
+struct event_loop *loop;
+struct timer_wheel wheel;
+struct sim_conn *conns;
+int conn_count;
+
+int device_count = MAX_DEVICES;
+int client_count = 16;
+double msg_A_rate = 1.0;    // Per device per second
+double request_rate = 50.0; // Per client per second
+int duration_sec = 10;
+bool use_c2r;
+
+uint64_t send_times[SEND_TIMES_SIZE];
+uint64_t next_seq;
+uint64_t *latencies;
+size_t latency_count;
+size_t latency_cap;
+
+uint64_t sent_msgs;
+uint64_t received_msgs;
+uint64_t c2_sent;
+uint64_t b_received;
+uint64_t disconnects;
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void close_sim(struct sim_conn *conn) {
+  if (conn->fd < 0)
+    return;
+  event_loop_remove(loop, conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  timer_wheel_cancel(&wheel, &conn->timer);
+  outq_free(&conn->out);
+  disconnects++;
+}
+
+void flush_sim(struct sim_conn *conn) {
+  int drained = outq_flush(&conn->out, conn->fd);
+  if (drained < 0) {
+    close_sim(conn);
+    return;
+  }
+  if (conn->want_write != !drained) {
+    conn->want_write = !drained;
+    event_loop_modify(loop, conn->fd,
+                      EVENT_READ | (conn->want_write ? EVENT_WRITE : 0));
+  }
+}
+
+void send_sim(struct sim_conn *conn, const uint8_t *payload, size_t len) {
+  uint8_t frame[FRAME_HEADER_SIZE + AES_MSG_SIZE];
+  struct out_buf *buf = out_buf_new(frame, frame_encode(frame, payload, len));
+  if (!buf)
+    return;
+  outq_push(&conn->out, buf);
+  out_buf_unref(buf);
+  sent_msgs++;
+  flush_sim(conn);
+}
+
+void record_latency(uint64_t ns) {
+  if (latency_count == latency_cap) {
+    size_t cap = latency_cap ? latency_cap * 2 : 1 << 16;
+    uint64_t *grown = realloc(latencies, sizeof(*latencies) * cap);
+    if (!grown)
+      return;
+    latencies = grown;
+    latency_cap = cap;
+  }
+  latencies[latency_count++] = ns;
+}
+
+void send_msg_A(struct sim_conn *conn) {
+  uint8_t msg[MSG_SIZE] = {MSG_TYPE_A, PASSCODE_LO, PASSCODE_HI,
+                           conn->device_id, -40};
+  for (int ch = 0; ch < 4; ch++) {
+    uint16_t adc = rand() & 0x3FF;
+    msg[5 + 2 * ch] = adc & 0xFF;
+    msg[6 + 2 * ch] = adc >> 8;
+  }
+  msg[15] = 0x11;
+  send_sim(conn, msg, sizeof(msg));
+}
+
+// C2 or C2R to a random device, carrying a sequence number for the RTT
+void send_msg_C2(struct sim_conn *conn) {
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  aes_ctx_t *aes = aes_thread_ctx(key);
+  uint8_t plain[MSG_SIZE] = {MSG_TYPE_B, PASSCODE_LO, PASSCODE_HI,
+                             rand() % device_count, 1, 0, 1};
+  uint64_t seq = next_seq++;
+  memcpy(plain + MSG_B_SEQ_IDX, &seq, sizeof(seq));
+
+  uint8_t msg[C2R_SIZE];
+  size_t len;
+  if (use_c2r) {
+    // Encrypted for the device by the client, the server only checks the tag
+    msg[0] = MSG_TYPE_C2R;
+    msg[C2R_DEVICE_IDX] = plain[3];
+    for (int i = 0; i < AES_IV_LENGTH_BYTE; i++)
+      msg[C2R_IV_IDX + i] = rand();
+    aes_ctx_encrypt(aes, plain, MSG_SIZE, msg + C2R_IV_IDX,
+                    msg + C2R_IV_IDX + AES_IV_LENGTH_BYTE);
+    aes_ctx_route_tag(aes, msg, C2R_TAG_IDX, msg + C2R_TAG_IDX);
+    len = C2R_SIZE;
+  } else {
+    msg[0] = MSG_TYPE_C2;
+    for (int i = 0; i < AES_IV_LENGTH_BYTE; i++)
+      msg[1 + i] = rand();
+    aes_ctx_encrypt(aes, plain, MSG_SIZE, msg + 1,
+                    msg + 1 + AES_IV_LENGTH_BYTE);
+    len = 1 + AES_IV_LENGTH_BYTE + MSG_SIZE + MSG_SIZE;
+  }
+  send_times[seq & (SEND_TIMES_SIZE - 1)] = now_ns();
+  c2_sent++;
+  send_sim(conn, msg, len);
+}
+
+void send_request(struct sim_conn *conn) {
+  uint8_t msg[3];
+  switch (conn->requests++ % 4) {
+  case 1:
+    msg[0] = MSG_TYPE_C1;
+    msg[1] = rand() % device_count;
+    send_sim(conn, msg, 2);
+    break;
+  case 3:
+    msg[0] = MSG_TYPE_C0;
+    msg[1] = CLIENT_PASSCODE & 0xFF;
+    msg[2] = CLIENT_PASSCODE >> 8;
+    send_sim(conn, msg, 3);
+    break;
+  default:
+    send_msg_C2(conn);
+  }
+}
+
+void on_tick(struct wheel_timer *timer, void *data) {
+  struct sim_conn *conn = data;
+  double rate = conn->device ? msg_A_rate : request_rate;
+  if (conn->device)
+    send_msg_A(conn);
+  else
+    send_request(conn);
+  if (conn->fd > -1)
+    timer_wheel_schedule(&wheel, timer, 1000.0 / rate);
+}
+
+// Msg B at a device: decrypt it like the firmware does and time the C2
+void handle_msg_B(const uint8_t *payload, int len) {
+  if (len < AES_IV_LENGTH_BYTE + MSG_SIZE + MSG_SIZE)
+    return;
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint8_t plain[MSG_SIZE + MSG_SIZE];
+  if (aes_ctx_decrypt(aes_thread_ctx(key), payload + AES_IV_LENGTH_BYTE,
+                      MSG_SIZE + MSG_SIZE, payload, plain) < 0 ||
+      plain[0] != MSG_TYPE_B)
+    return;
+  uint64_t seq;
+  memcpy(&seq, plain + MSG_B_SEQ_IDX, sizeof(seq));
+  if (seq >= next_seq || next_seq - seq > SEND_TIMES_SIZE)
+    return;
+  b_received++;
+  record_latency(now_ns() - send_times[seq & (SEND_TIMES_SIZE - 1)]);
+}
+
+void on_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+  struct sim_conn *conn = data;
+  if (events & EVENT_WRITE)
+    flush_sim(conn);
+  if (!(events & EVENT_READ) || conn->fd < 0)
+    return;
+
+  uint8_t payload[FRAME_MAX_PAYLOAD];
+  while (1) {
+    ssize_t n = frame_ring_fill(&conn->rx, conn->fd);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      close_sim(conn);
+      return;
+    }
+    int len;
+    while ((len = frame_ring_next(&conn->rx, payload, sizeof(payload))) > 0) {
+      received_msgs++;
+      if (conn->device)
+        handle_msg_B(payload, len);
+    }
+    if (len < 0) {
+      printf("Corrupt frame on connection %d\n", conn->fd);
+      close_sim(conn);
+      return;
+    }
+  }
+}
+
+int connect_sim(struct sim_conn *conn) {
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(SERVER_PORT),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    perror("Socket creation failed");
+    return -1;
+  }
+  if (connect(conn->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("Connect failed");
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return 0;
+}
+
+void on_timer(struct event_loop *loop, int fd, uint32_t events, void *data) {
+  timer_wheel_process(data);
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+double percentile_us(double p) {
+  if (latency_count == 0)
+    return 0;
+  size_t i = p * (latency_count - 1);
+  return latencies[i] / 1e3;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-d devices] [-c clients] [-a msg A/s per device] "
+         "[-r requests/s per client] [-T seconds] [-x]\n",
+         prog);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d:c:a:r:T:xh")) != -1) {
+    switch (opt) {
+    case 'd':
+      device_count = atoi(optarg);
+      break;
+    case 'c':
+      client_count = atoi(optarg);
+      break;
+    case 'a':
+      msg_A_rate = atof(optarg);
+      break;
+    case 'r':
+      request_rate = atof(optarg);
+      break;
+    case 'T':
+      duration_sec = atoi(optarg);
+      break;
+    case 'x':
+      use_c2r = true;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if (device_count < 1 || device_count > MAX_DEVICES || client_count < 0 ||
+      msg_A_rate <= 0 || request_rate <= 0 || duration_sec < 1) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // One fd per connection plus a few for the loop
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  conn_count = device_count + client_count;
+  conns = calloc(conn_count, sizeof(*conns));
+  loop = event_loop_create(EVENT_BACKEND_EPOLL);
+  if (!conns || !loop || timer_wheel_init(&wheel, LOADGEN_TICK_MS) < 0 ||
+      event_loop_add(loop, timer_wheel_fd(&wheel), EVENT_READ, on_timer,
+                     &wheel)) {
+    printf("Could not set up the event loop\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < conn_count; i++) {
+    struct sim_conn *conn = &conns[i];
+    conn->device = i < device_count;
+    conn->device_id = i;
+    frame_ring_init(&conn->rx);
+    outq_init(&conn->out);
+    if (connect_sim(conn) < 0)
+      exit(EXIT_FAILURE);
+  }
+  double setup_sec = (now_ns() - start) / 1e9;
+  printf("%d connections in %.3f s (%.0f connections/s)\n", conn_count,
+         setup_sec, conn_count / setup_sec);
+
+  for (int i = 0; i < conn_count; i++) {
+    struct sim_conn *conn = &conns[i];
+    int flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        event_loop_add(loop, conn->fd, EVENT_READ, on_event, conn) < 0) {
+      printf("Could not watch connection %d\n", conn->fd);
+      exit(EXIT_FAILURE);
+    }
+    /* Spread the first sends over one period. Clients start once every
+       device has sent a Msg A, so no C2 goes to an unknown device */
+    double period_ms = 1000.0 / (conn->device ? msg_A_rate : request_rate);
+    uint64_t delay_ms = rand() % (int)(period_ms + 1);
+    if (!conn->device)
+      delay_ms += 1000.0 / msg_A_rate + LOADGEN_TICK_MS;
+    wheel_timer_init(&conn->timer, on_tick, conn);
+    timer_wheel_schedule(&wheel, &conn->timer, delay_ms);
+  }
+
+  printf("Running %d devices at %.2f msg A/s and %d clients at %.1f "
+         "requests/s for %d s (%s)\n",
+         device_count, msg_A_rate, client_count, request_rate, duration_sec,
+         use_c2r ? "C2R" : "C2");
+  start = now_ns();
+  uint64_t end = start + duration_sec * 1000000000ULL;
+  while (now_ns() < end)
+    event_loop_run_once(loop, 100);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  qsort(latencies, latency_count, sizeof(*latencies), compare_u64);
+  printf("sent %.0f msgs/s, received %.0f msgs/s\n", sent_msgs / elapsed,
+         received_msgs / elapsed);
+  printf("C2 sent %lu, Msg B received %lu, disconnects %lu\n", c2_sent,
+         b_received, disconnects);
+  printf("C2 to B round trip: p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+         percentile_us(0.5), percentile_us(0.99), percentile_us(0.999));
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_FLUSH_US 10000
+
+static const char *const level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static _Atomic(struct log_ring *) rings;
+static atomic_int ring_count;
+static __thread struct log_ring *ring;
+// One formatter at a time, the thread or log_flush at exit
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocates the calling thread's ring on its first record
+static struct log_ring *register_ring(void) {
+  struct log_ring *r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+  r->thread = atomic_fetch_add(&ring_count, 1);
+  r->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+    ;
+  return r;
+}
+
+void log_write(int level, const char *fmt, const long *args) {
+  if (!ring && !(ring = register_ring()))
+    return;
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct log_record *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  record->fmt = fmt;
+  record->level = level;
+  for (int i = 0; i < LOG_ARGS_MAX; i++)
+    record->args[i] = args[i + 1];
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void format_record(int thread, const struct log_record *record) {
+  time_t sec = record->time / 1000000000;
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  printf("%02d:%02d:%02d.%06lu %-5s [%d] ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+         (unsigned long)(record->time % 1000000000) / 1000,
+         level_names[record->level], thread);
+  printf(record->fmt, record->args[0], record->args[1], record->args[2],
+         record->args[3]);
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&flush_lock);
+  for (struct log_ring *r = atomic_load(&rings); r; r = r->next) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    for (; tail != head; tail++)
+      format_record(r->thread, &r->records[tail & (LOG_RING_SIZE - 1)]);
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange(&r->dropped, 0);
+    if (dropped)
+      printf("Log ring of thread %d full, dropped %lu record(s)\n", r->thread,
+             dropped);
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&flush_lock);
+}
+
+static void *log_run(void *arg) {
+  while (1) {
+    log_flush();
+    usleep(LOG_FLUSH_US);
+  }
+  return NULL;
+}
+
+int log_start(void) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, log_run, NULL)) {
+    perror("Could not start log thread");
+    return -1;
+  }
+  pthread_detach(thread);
+  atexit(log_flush);
+  return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// Calls below this level are compiled out, arguments included
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_ARGS_MAX 4
+#define LOG_RING_SIZE 4096 // Records per thread, power of two
+
+/* Logging only copies a record into the calling thread's ring; a
+   background thread formats and writes it later. The format must be a
+   string literal. Arguments are stored as long, so use %ld, %lu or %lx,
+   at most LOG_ARGS_MAX of them, and no strings. */
+#define LOG_AT(level, fmt, ...)                                                \
+  do {                                                                         \
+    if ((level) >= LOG_LEVEL)                                                  \
+      log_write(level, fmt, (long[LOG_ARGS_MAX + 1]){0, ##__VA_ARGS__});       \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+struct log_record {
+  uint64_t time; // CLOCK_REALTIME in ns
+  const char *fmt;
+  long args[LOG_ARGS_MAX];
+  int level;
+};
+
+/* Single producer, single consumer ring owned by one thread. A full ring
+   drops new records and counts them, logging never blocks. */
+struct log_ring {
+  _Alignas(64) atomic_uint head; // Written by the owning thread
+  _Alignas(64) atomic_uint tail; // Written by the formatter
+  atomic_ulong dropped;
+  int thread;           // Registration order, printed with each record
+  struct log_ring *next; // All rings, newest first
+  struct log_record records[LOG_RING_SIZE];
+};
+
+// args[0] is a placeholder, the format's arguments start at args[1]
+void log_write(int level, const char *fmt, const long *args);
+
+/* Starts the formatter thread, writing to stdout every few milliseconds,
+   and drains what is left at exit. Records logged before it starts wait
+   in their rings. */
+int log_start(void);
+
+// Formats and writes every record queued so far
+void log_flush(void);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mailbox.h"
+
+static void push(struct mailbox *mailbox, struct mail_node *node) {
+  atomic_store(&node->next, NULL);
+  struct mail_node *prev = atomic_exchange(&mailbox->head, node);
+  atomic_store(&prev->next, node);
+}
+
+int mailbox_init(struct mailbox *mailbox) {
+  atomic_store(&mailbox->stub.next, NULL);
+  atomic_store(&mailbox->head, &mailbox->stub);
+  mailbox->tail = &mailbox->stub;
+  atomic_store(&mailbox->signalled, false);
+  mailbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return mailbox->event_fd < 0 ? -1 : 0;
+}
+
+void mailbox_destroy(struct mailbox *mailbox) {
+  if (mailbox->event_fd > -1)
+    close(mailbox->event_fd);
+  mailbox->event_fd = -1;
+}
+
+void mailbox_post(struct mailbox *mailbox, struct mail_node *node) {
+  push(mailbox, node);
+  // Only the first post after a drain pays for the eventfd write
+  if (!atomic_exchange(&mailbox->signalled, true)) {
+    uint64_t one = 1;
+    ssize_t ret = write(mailbox->event_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
+
+void mailbox_begin_drain(struct mailbox *mailbox) {
+  uint64_t count;
+  ssize_t ret = read(mailbox->event_fd, &count, sizeof(count));
+  (void)ret;
+  /* Clear before draining: a post that saw the flag still set is already
+     visible to the takes that follow */
+  atomic_store(&mailbox->signalled, false);
+}
+
+struct mail_node *mailbox_take(struct mailbox *mailbox) {
+  struct mail_node *tail = mailbox->tail;
+  struct mail_node *next = atomic_load(&tail->next);
+
+  if (tail == &mailbox->stub) {
+    if (!next)
+      return NULL;
+    mailbox->tail = next;
+    tail = next;
+    next = atomic_load(&next->next);
+  }
+  if (next) {
+    mailbox->tail = next;
+    return tail;
+  }
+
+  // tail is the last node; a producer may be between exchange and link
+  if (tail != atomic_load(&mailbox->head))
+    return NULL;
+  push(mailbox, &mailbox->stub);
+  next = atomic_load(&tail->next);
+  if (next) {
+    mailbox->tail = next;
+    return tail;
+  }
+  return NULL;
+}
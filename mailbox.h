@@ -0,0 +1,33 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Lock-free multi-producer single-consumer mailbox (intrusive Vyukov
+   queue). Any thread may post; only the owning thread takes. The owner
+   watches event_fd, which is signalled at most once per drain. */
+struct mail_node {
+  _Atomic(struct mail_node *) next;
+};
+
+struct mailbox {
+  _Atomic(struct mail_node *) head; // Producers push here
+  struct mail_node *tail;           // Consumer pops here
+  struct mail_node stub;
+  atomic_bool signalled;
+  int event_fd;
+};
+
+int mailbox_init(struct mailbox *mailbox);
+
+void mailbox_destroy(struct mailbox *mailbox);
+
+void mailbox_post(struct mailbox *mailbox, struct mail_node *node);
+
+/* Consumer side. Call mailbox_begin_drain() when event_fd is readable, then
+   mailbox_take() until it returns NULL. */
+void mailbox_begin_drain(struct mailbox *mailbox);
+
+struct mail_node *mailbox_take(struct mailbox *mailbox);
+
+#endif
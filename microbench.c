@@ -0,0 +1,334 @@
+/*
+
+Microbenchmarks of the per-message hot paths. The server is compiled in
+without its main so the handlers run exactly as in production, on a
+single worker with no threads. Every benchmark runs a warm-up and then
+BENCH_REPS timed repetitions; the ns/op of the repetitions is reported as
+CSV on stdout:
+
+  benchmark,iterations,repetitions,median_ns,min_ns,max_ns,mad_ns
+
+The server's own logging goes to /dev/null while a benchmark runs.
+
+*/
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+#include "hal.h"
+
+#define BENCH_REPS 15
+#define BENCH_ITERATIONS 20000
+#define BENCH_DEVICES 1000
+#define BENCH_DEVICE_ID 1
+
+struct worker bench_worker;
+FILE *results;
+int reps = BENCH_REPS;
+const char *filter;
+
+struct connection *client_conn;
+struct connection *device_conn;
+
+uint8_t msg_A[MSG_SIZE];
+uint8_t msg_A2[AES_MSG_SIZE];
+size_t msg_A2_len;
+struct msg_A2_fields packed;
+uint8_t msg_C0[AES_MSG_SIZE];
+uint8_t msg_C1[AES_MSG_SIZE];
+uint8_t msg_C2[AES_MSG_SIZE];
+uint8_t msg_C2R[AES_MSG_SIZE];
+uint8_t msg_C3[AES_MSG_SIZE];
+uint8_t plain[MSG_SIZE];
+uint8_t cipher[MSG_SIZE + MSG_SIZE];
+uint8_t iv[AES_IV_LENGTH_BYTE];
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drops replies queued by the last repetition, outside the timed region
+void reset_queues(void) {
+  outq_free(&client_conn->out);
+  outq_free(&device_conn->out);
+}
+
+void run(const char *name, void (*op)(int iterations), int iterations) {
+  if (filter && !strstr(name, filter))
+    return;
+
+  double ns[BENCH_REPS * 4];
+  op(iterations); // Warm-up
+  reset_queues();
+  for (int r = 0; r < reps; r++) {
+    double start = now_sec();
+    op(iterations);
+    ns[r] = (now_sec() - start) * 1e9 / iterations;
+    reset_queues();
+  }
+
+  qsort(ns, reps, sizeof(*ns), compare_double);
+  double median = ns[reps / 2];
+  double dev[BENCH_REPS * 4];
+  for (int r = 0; r < reps; r++)
+    dev[r] = ns[r] > median ? ns[r] - median : median - ns[r];
+  qsort(dev, reps, sizeof(*dev), compare_double);
+  fprintf(results, "%s,%d,%d,%.1f,%.1f,%.1f,%.1f\n", name, iterations, reps,
+          median, ns[0], ns[reps - 1], dev[reps / 2]);
+  fflush(results);
+}
+
+void bench_encryptAES(int iterations) {
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  for (int i = 0; i < iterations; i++)
+    encryptAES(plain, MSG_SIZE, key, iv, cipher);
+}
+
+void bench_decryptAES(int iterations) {
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint8_t out[MSG_SIZE + MSG_SIZE];
+  for (int i = 0; i < iterations; i++)
+    decryptAES(cipher, sizeof(cipher), key, iv, out);
+}
+
+void bench_aes_ctx_encrypt(int iterations) {
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint8_t out[MSG_SIZE + MSG_SIZE];
+  for (int i = 0; i < iterations; i++)
+    aes_ctx_encrypt(aes_thread_ctx(key), plain, MSG_SIZE, iv, out);
+}
+
+void bench_aes_ctx_decrypt(int iterations) {
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint8_t out[MSG_SIZE + MSG_SIZE];
+  for (int i = 0; i < iterations; i++)
+    aes_ctx_decrypt(aes_thread_ctx(key), cipher, sizeof(cipher), iv, out);
+}
+
+void bench_parse_msg_A(int iterations) {
+  struct device_s *device = registry_find(&self->registry, BENCH_DEVICE_ID);
+  for (int i = 0; i < iterations; i++)
+    parse_msg_A(device, (const char *)msg_A);
+}
+
+void bench_store_data(int iterations) {
+  for (int i = 0; i < iterations; i++)
+    store_data(device_conn->fd, (const char *)msg_A);
+}
+
+void bench_get_device_list(int iterations) {
+  char out[MSG_SIZE];
+  for (int i = 0; i < iterations; i++)
+    get_device_list(out);
+}
+
+void dispatch(int iterations, const uint8_t *msg, size_t len, int in_socket) {
+  uint8_t out[AES_MSG_SIZE];
+  size_t out_len;
+  for (int i = 0; i < iterations; i++)
+    handle_client_message(in_socket, msg, len, out, &out_len);
+}
+
+void bench_handle_A(int iterations) {
+  uint8_t msg[AES_MSG_SIZE] = {0};
+  memcpy(msg, msg_A, MSG_SIZE);
+  dispatch(iterations, msg, sizeof(msg), device_conn->fd);
+}
+
+void bench_handle_A2(int iterations) {
+  dispatch(iterations, msg_A2, msg_A2_len, device_conn->fd);
+}
+
+void bench_handle_C0(int iterations) {
+  dispatch(iterations, msg_C0, sizeof(msg_C0), client_conn->fd);
+}
+
+void bench_handle_C1(int iterations) {
+  dispatch(iterations, msg_C1, sizeof(msg_C1), client_conn->fd);
+}
+
+void bench_handle_C2(int iterations) {
+  dispatch(iterations, msg_C2, sizeof(msg_C2), client_conn->fd);
+}
+
+void bench_handle_C2R(int iterations) {
+  dispatch(iterations, msg_C2R, sizeof(msg_C2R), client_conn->fd);
+}
+
+void bench_handle_C3(int iterations) {
+  dispatch(iterations, msg_C3, sizeof(msg_C3), client_conn->fd);
+}
+
+// What the metrics add around every handled message
+void bench_stats_record(int iterations) {
+  for (int i = 0; i < iterations; i++) {
+    uint64_t start = stats_now();
+    stats_record_since(&self->stats.handle[MSG_TYPE_C0], start);
+    stats_add(&self->stats.messages[MSG_TYPE_C0], 1);
+  }
+}
+
+// From device.c, linked in without its main
+void gen_msg_A(uint8_t buffer[MSG_SIZE]);
+
+// The firmware's own gen_msg_A, reading the simulated board's ADC and lines
+void bench_gen_msg_A(int iterations) {
+  uint8_t buffer[MSG_SIZE];
+  for (int i = 0; i < iterations; i++)
+    gen_msg_A(buffer);
+  // Keep the packing from being optimised away
+  if (buffer[0] != MSG_TYPE_A)
+    abort();
+}
+
+// A full Msg A2 of slowly moving readings, as the device packs it
+void bench_msg_A2_pack(int iterations) {
+  uint8_t buffer[MSG_A2_MAX_SIZE];
+  for (int i = 0; i < iterations; i++) {
+    packed.adc[0][0] = i & 0x3FF;
+    msg_A2_pack(buffer, &packed);
+  }
+  if (buffer[0] != MSG_TYPE_A2)
+    abort();
+}
+
+struct connection *bench_connection(int fd) {
+  struct sockaddr_in address = {.sin_family = AF_INET};
+  struct connection *conn = open_connection(fd, &address);
+  if (!conn)
+    exit(EXIT_FAILURE);
+  conn->framing = FRAMING_FRAMED;
+  return conn;
+}
+
+void setup(void) {
+  self = workers = &bench_worker;
+  worker_count = 1;
+  outq_limit = SIZE_MAX;
+  if (registry_init(&self->registry, BENCH_DEVICES * 2) < 0 ||
+      directory_init(&directory, REGISTRY_INITIAL_CAPACITY) < 0 ||
+      !(self->loop = event_loop_create(EVENT_BACKEND_EPOLL)) ||
+      timer_wheel_init(&self->wheel, SERVER_TICK_MS) < 0) {
+    printf("Could not set up the worker\n");
+    exit(EXIT_FAILURE);
+  }
+  if (hal_init(HAL_BACKEND_SIM) < 0) {
+    printf("Could not set up the simulated board\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Replies are queued, never written, so the socket ends stay idle
+  int client_fds[2], device_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, client_fds) < 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, device_fds) < 0) {
+    perror("socketpair failed");
+    exit(EXIT_FAILURE);
+  }
+  client_conn = bench_connection(client_fds[0]);
+  device_conn = bench_connection(device_fds[0]);
+
+  // A fleet with every other device online
+  for (uint32_t id = BENCH_DEVICE_ID + 1; id < BENCH_DEVICES; id++)
+    registry_set_online(&self->registry, registry_add(&self->registry, id),
+                        id % 2);
+
+  struct msg_A_fields fields = {PASSCODE_LO | PASSCODE_HI << 8,
+                                BENCH_DEVICE_ID, -33, {1, 2, 3, 4}, 5, 0x11};
+  msg_A_pack(msg_A, &fields);
+  store_data(device_conn->fd, (const char *)msg_A);
+
+  packed = (struct msg_A2_fields){PASSCODE_LO | PASSCODE_HI << 8,
+                                  BENCH_DEVICE_ID, -33, 5, 0x11, 10, 0,
+                                  MSG_A2_MAX_SAMPLES};
+  for (int i = 0; i < MSG_A2_MAX_SAMPLES; i++) {
+    for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+      packed.adc[i][ch] = 500 + ch * 100 + (i * 3 + ch) % 7;
+  }
+  msg_A2_len = msg_A2_pack(msg_A2, &packed);
+
+  msg_C0[0] = MSG_TYPE_C0;
+  msg_C0[1] = CLIENT_PASSCODE & 0xFF;
+  msg_C0[2] = CLIENT_PASSCODE >> 8;
+  msg_C1[0] = MSG_TYPE_C1;
+  msg_C1[1] = BENCH_DEVICE_ID;
+
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  aes_ctx_t *aes = aes_thread_ctx(key);
+  uint8_t msg_B[MSG_SIZE] = {MSG_TYPE_B, PASSCODE_LO, PASSCODE_HI,
+                             BENCH_DEVICE_ID, 1, 0, 1};
+  memcpy(plain, msg_B, MSG_SIZE);
+  aes_ctx_encrypt(aes, plain, MSG_SIZE, iv, cipher);
+
+  msg_C2[0] = MSG_TYPE_C2;
+  memcpy(msg_C2 + 1, iv, AES_IV_LENGTH_BYTE);
+  memcpy(msg_C2 + 1 + AES_IV_LENGTH_BYTE, cipher, sizeof(cipher));
+
+  msg_C2R[0] = MSG_TYPE_C2R;
+  msg_C2R[C2R_DEVICE_IDX] = BENCH_DEVICE_ID;
+  memcpy(msg_C2R + C2R_IV_IDX, iv, AES_IV_LENGTH_BYTE);
+  memcpy(msg_C2R + C2R_IV_IDX + AES_IV_LENGTH_BYTE, cipher, sizeof(cipher));
+  aes_ctx_route_tag(aes, msg_C2R, C2R_TAG_IDX, msg_C2R + C2R_TAG_IDX);
+
+  // Whole history, one D3 per D3_MAX_SAMPLES samples
+  msg_C3[0] = MSG_TYPE_C3;
+  msg_C3[C3_DEVICE_IDX] = BENCH_DEVICE_ID;
+  memset(msg_C3 + C3_TO_IDX, 0xFF, 4);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "r:f:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      reps = atoi(optarg);
+      if (reps < 1 || reps > BENCH_REPS * 4) {
+        printf("Repetitions must be between 1 and %d\n", BENCH_REPS * 4);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      printf("Usage: %s [-r repetitions] [-f name filter]\n", argv[0]);
+      exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  // Results keep the real stdout, the server's printf go to /dev/null
+  results = fdopen(dup(STDOUT_FILENO), "w");
+  if (!results || !freopen("/dev/null", "w", stdout)) {
+    perror("Could not redirect stdout");
+    exit(EXIT_FAILURE);
+  }
+
+  setup();
+  fprintf(results,
+          "benchmark,iterations,repetitions,median_ns,min_ns,max_ns,mad_ns\n");
+  run("encryptAES", bench_encryptAES, BENCH_ITERATIONS);
+  run("decryptAES", bench_decryptAES, BENCH_ITERATIONS);
+  run("aes_ctx_encrypt", bench_aes_ctx_encrypt, BENCH_ITERATIONS);
+  run("aes_ctx_decrypt", bench_aes_ctx_decrypt, BENCH_ITERATIONS);
+  run("parse_msg_A", bench_parse_msg_A, BENCH_ITERATIONS);
+  run("store_data", bench_store_data, BENCH_ITERATIONS);
+  run("get_device_list", bench_get_device_list, BENCH_ITERATIONS);
+  run("handle_client_message/A", bench_handle_A, BENCH_ITERATIONS);
+  run("handle_client_message/A2", bench_handle_A2, BENCH_ITERATIONS);
+  run("handle_client_message/C0", bench_handle_C0, BENCH_ITERATIONS);
+  run("handle_client_message/C1", bench_handle_C1, BENCH_ITERATIONS);
+  run("handle_client_message/C2", bench_handle_C2, BENCH_ITERATIONS);
+  run("handle_client_message/C2R", bench_handle_C2R, BENCH_ITERATIONS);
+  // Each C3 queues a run of D3 replies, keep the queues small
+  run("handle_client_message/C3", bench_handle_C3, BENCH_ITERATIONS / 10);
+  run("gen_msg_A", bench_gen_msg_A, BENCH_ITERATIONS);
+  run("msg_A2_pack", bench_msg_A2_pack, BENCH_ITERATIONS);
+  run("stats_record", bench_stats_record, BENCH_ITERATIONS);
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+
+struct out_buf *out_buf_new(const uint8_t *data, size_t len) {
+  struct out_buf *buf = malloc(sizeof(*buf) + len);
+  if (!buf)
+    return NULL;
+  atomic_init(&buf->refs, 1);
+  buf->len = len;
+  memcpy(buf->data, data, len);
+  return buf;
+}
+
+struct out_buf *out_buf_ref(struct out_buf *buf) {
+  atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+  return buf;
+}
+
+void out_buf_unref(struct out_buf *buf) {
+  if (buf && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1)
+    free(buf);
+}
+
+void outq_init(struct outq *q) { memset(q, 0, sizeof(*q)); }
+
+void outq_free(struct outq *q) {
+  for (uint32_t i = 0; i < q->count; i++)
+    out_buf_unref(q->bufs[(q->head + i) % q->cap]);
+  free(q->bufs);
+  outq_init(q);
+}
+
+int outq_push(struct outq *q, struct out_buf *buf) {
+  if (q->count == q->cap) {
+    uint32_t cap = q->cap ? q->cap * 2 : 4;
+    struct out_buf **bufs = malloc(sizeof(*bufs) * cap);
+    if (!bufs)
+      return -1;
+    for (uint32_t i = 0; i < q->count; i++)
+      bufs[i] = q->bufs[(q->head + i) % q->cap];
+    free(q->bufs);
+    q->bufs = bufs;
+    q->cap = cap;
+    q->head = 0;
+  }
+  q->bufs[(q->head + q->count) % q->cap] = out_buf_ref(buf);
+  q->count++;
+  q->bytes += buf->len;
+  return 0;
+}
+
+int outq_flush(struct outq *q, int fd) {
+  while (q->count > 0) {
+    struct iovec iov[OUTQ_IOV_MAX];
+    int iovcnt = 0;
+    for (uint32_t i = 0; i < q->count && iovcnt < OUTQ_IOV_MAX; i++) {
+      struct out_buf *buf = q->bufs[(q->head + i) % q->cap];
+      size_t skip = i == 0 ? q->offset : 0;
+      iov[iovcnt].iov_base = buf->data + skip;
+      iov[iovcnt].iov_len = buf->len - skip;
+      iovcnt++;
+    }
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+
+    // Release fully sent buffers, remember how far into the next one we got
+    q->bytes -= sent;
+    size_t left = q->offset + sent;
+    while (q->count > 0) {
+      struct out_buf *buf = q->bufs[q->head];
+      if (left < buf->len)
+        break;
+      left -= buf->len;
+      out_buf_unref(buf);
+      q->head = (q->head + 1) % q->cap;
+      q->count--;
+    }
+    q->offset = left;
+  }
+  return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTQ_IOV_MAX 64
+
+/* Immutable reference counted message. One buffer can sit in many queues,
+   on any thread, and is freed when the last one lets go. */
+struct out_buf {
+  atomic_int refs;
+  size_t len;
+  uint8_t data[];
+};
+
+struct out_buf *out_buf_new(const uint8_t *data, size_t len);
+
+struct out_buf *out_buf_ref(struct out_buf *buf);
+
+void out_buf_unref(struct out_buf *buf);
+
+// Per-connection FIFO of buffers waiting for the socket to become writable
+struct outq {
+  struct out_buf **bufs; // Ring of cap entries
+  uint32_t head;
+  uint32_t count;
+  uint32_t cap;
+  size_t offset; // Bytes of the head buffer already sent
+  size_t bytes;  // Bytes queued and not sent yet
+};
+
+void outq_init(struct outq *q);
+
+void outq_free(struct outq *q);
+
+// Takes a new reference to buf
+int outq_push(struct outq *q, struct out_buf *buf);
+
+/* Sends queued buffers with sendmsg, up to OUTQ_IOV_MAX per call. Returns 1
+   once empty, 0 if the socket is full, -1 on a socket error. */
+int outq_flush(struct outq *q, int fd);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+static uint32_t hash_id(uint32_t id) {
+  // Murmur3 finalizer, spreads small sequential ids over the table
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id;
+}
+
+static size_t probe(const struct registry_slot *slots, size_t capacity,
+                    uint32_t id) {
+  size_t mask = capacity - 1;
+  size_t i = hash_id(id) & mask;
+  while (slots[i].index && slots[i].id != id)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static int grow(struct device_registry *reg) {
+  size_t capacity = reg->capacity * 2;
+  struct registry_slot *slots = calloc(capacity, sizeof(*slots));
+  uint32_t *ids = realloc(reg->ids, sizeof(*ids) * capacity / 2);
+  if (ids)
+    reg->ids = ids;
+  uint8_t *online = realloc(reg->online, sizeof(*online) * capacity / 2);
+  if (online)
+    reg->online = online;
+  if (!slots || !ids || !online) {
+    free(slots);
+    return -1;
+  }
+
+  for (size_t i = 0; i < reg->count; i++)
+    slots[probe(slots, capacity, ids[i])] =
+        (struct registry_slot){ids[i], i + 1};
+
+  free(reg->slots);
+  reg->slots = slots;
+  reg->capacity = capacity;
+  return 0;
+}
+
+int registry_init(struct device_registry *reg, size_t capacity) {
+  memset(reg, 0, sizeof(*reg));
+  reg->capacity = REGISTRY_INITIAL_CAPACITY;
+  while (reg->capacity < capacity)
+    reg->capacity *= 2;
+
+  reg->slots = calloc(reg->capacity, sizeof(*reg->slots));
+  reg->ids = malloc(sizeof(*reg->ids) * reg->capacity / 2);
+  reg->online = malloc(sizeof(*reg->online) * reg->capacity / 2);
+  if (!reg->slots || !reg->ids || !reg->online) {
+    registry_free(reg);
+    return -1;
+  }
+  return 0;
+}
+
+void registry_free(struct device_registry *reg) {
+  for (size_t i = 0; i < reg->chunk_count; i++) {
+    free(reg->chunks[i]);
+    free(reg->msg_chunks[i]);
+  }
+  free(reg->chunks);
+  free(reg->msg_chunks);
+  free(reg->ids);
+  free(reg->online);
+  free(reg->slots);
+  free(reg->by_socket);
+  memset(reg, 0, sizeof(*reg));
+}
+
+struct device_s *registry_device(const struct device_registry *reg,
+                                 size_t index) {
+  return &reg->chunks[index / REGISTRY_CHUNK_SIZE]
+                     [index & (REGISTRY_CHUNK_SIZE - 1)];
+}
+
+struct device_msgs *registry_msgs(const struct device_registry *reg,
+                                  size_t index) {
+  return &reg->msg_chunks[index / REGISTRY_CHUNK_SIZE]
+                         [index & (REGISTRY_CHUNK_SIZE - 1)];
+}
+
+struct device_s *registry_find(const struct device_registry *reg,
+                               uint32_t id) {
+  const struct registry_slot *slot =
+      &reg->slots[probe(reg->slots, reg->capacity, id)];
+  return slot->index ? registry_device(reg, slot->index - 1) : NULL;
+}
+
+struct device_s *registry_add(struct device_registry *reg, uint32_t id) {
+  size_t i = probe(reg->slots, reg->capacity, id);
+  if (reg->slots[i].index)
+    return registry_device(reg, reg->slots[i].index - 1);
+
+  // Keep the load factor at or below 1/2 so probe sequences stay short
+  if (reg->count + 1 > reg->capacity / 2) {
+    if (grow(reg) < 0)
+      return NULL;
+    i = probe(reg->slots, reg->capacity, id);
+  }
+
+  if (reg->count == reg->chunk_count * REGISTRY_CHUNK_SIZE) {
+    struct device_s **chunks =
+        realloc(reg->chunks, sizeof(*chunks) * (reg->chunk_count + 1));
+    if (chunks)
+      reg->chunks = chunks;
+    struct device_msgs **msg_chunks = realloc(
+        reg->msg_chunks, sizeof(*msg_chunks) * (reg->chunk_count + 1));
+    if (msg_chunks)
+      reg->msg_chunks = msg_chunks;
+    if (!chunks || !msg_chunks)
+      return NULL;
+    chunks[reg->chunk_count] =
+        calloc(REGISTRY_CHUNK_SIZE, sizeof(struct device_s));
+    msg_chunks[reg->chunk_count] =
+        calloc(REGISTRY_CHUNK_SIZE, sizeof(struct device_msgs));
+    if (!chunks[reg->chunk_count] || !msg_chunks[reg->chunk_count]) {
+      free(chunks[reg->chunk_count]);
+      free(msg_chunks[reg->chunk_count]);
+      return NULL;
+    }
+    reg->chunk_count++;
+  }
+
+  size_t index = reg->count++;
+  struct device_s *device = registry_device(reg, index);
+  device->id = id;
+  device->index = index;
+  device->socket = -1;
+
+  reg->slots[i] = (struct registry_slot){id, index + 1};
+  reg->ids[index] = id;
+  reg->online[index] = 0;
+  return device;
+}
+
+struct device_s *registry_find_by_socket(const struct device_registry *reg,
+                                         int socket) {
+  if (socket < 0 || socket >= reg->by_socket_cap)
+    return NULL;
+  return reg->by_socket[socket];
+}
+
+int registry_bind_socket(struct device_registry *reg, struct device_s *device,
+                         int socket) {
+  if (socket < 0)
+    return -1;
+  if (socket >= reg->by_socket_cap) {
+    int cap = reg->by_socket_cap ? reg->by_socket_cap : 64;
+    while (cap <= socket)
+      cap *= 2;
+    struct device_s **by_socket =
+        realloc(reg->by_socket, sizeof(*by_socket) * cap);
+    if (!by_socket)
+      return -1;
+    memset(by_socket + reg->by_socket_cap, 0,
+           sizeof(*by_socket) * (cap - reg->by_socket_cap));
+    reg->by_socket = by_socket;
+    reg->by_socket_cap = cap;
+  }
+
+  registry_unbind_socket(reg, device);
+  // A socket carries at most one device; a new device id on it takes over
+  struct device_s *previous = reg->by_socket[socket];
+  if (previous) {
+    previous->socket = -1;
+    reg->online[previous->index] = 0;
+  }
+  reg->by_socket[socket] = device;
+  device->socket = socket;
+  reg->online[device->index] = 1;
+  return 0;
+}
+
+void registry_unbind_socket(struct device_registry *reg,
+                            struct device_s *device) {
+  if (device->socket > -1 && device->socket < reg->by_socket_cap &&
+      reg->by_socket[device->socket] == device)
+    reg->by_socket[device->socket] = NULL;
+  device->socket = -1;
+  reg->online[device->index] = 0;
+}
+
+void registry_set_online(struct device_registry *reg, struct device_s *device,
+                         int online) {
+  reg->online[device->index] = online;
+}
+
+int registry_list_online(const struct device_registry *reg, uint32_t *ids,
+                         int max) {
+  int n = 0;
+  for (size_t i = 0; i < reg->count && n < max; i++)
+    if (reg->online[i])
+      ids[n++] = reg->ids[i];
+  return n;
+}
@@ -0,0 +1,74 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server.h"
+
+#define REGISTRY_INITIAL_CAPACITY 64
+#define REGISTRY_CHUNK_SIZE 1024 // Devices per allocation, power of two
+
+// Hash table slot. index is the device's dense index + 1, 0 when empty
+struct registry_slot {
+  uint32_t id;
+  uint32_t index;
+};
+
+/* Runtime device registry, laid out as a struct of arrays. Devices are found
+   by id through an open-addressing (linear probing) table holding id and
+   dense index, so a lookup reads no device state. ids and online are dense,
+   in registration order, for fleet scans. The device structs live in
+   fixed-size chunks and are never moved or removed, so device pointers stay
+   valid. Their message buffers are in chunks of their own, so scans over
+   device structs do not pull them into cache. Sockets map back to devices
+   through a fd-indexed reverse index. */
+struct device_registry {
+  struct registry_slot *slots;
+  size_t capacity; // Power of two
+  uint32_t *ids;
+  uint8_t *online; // Connected, or restored and not yet timed out
+  size_t count;
+  struct device_s **chunks;
+  struct device_msgs **msg_chunks; // Same layout as chunks
+  size_t chunk_count;
+  struct device_s **by_socket;
+  int by_socket_cap;
+};
+
+int registry_init(struct device_registry *reg, size_t capacity);
+
+void registry_free(struct device_registry *reg);
+
+struct device_s *registry_find(const struct device_registry *reg,
+                               uint32_t id);
+
+// Returns the device with the given id, registering it if it is unknown
+struct device_s *registry_add(struct device_registry *reg, uint32_t id);
+
+// Device at a dense index, index < count
+struct device_s *registry_device(const struct device_registry *reg,
+                                 size_t index);
+
+// Message buffers of the device at a dense index, index < count
+struct device_msgs *registry_msgs(const struct device_registry *reg,
+                                  size_t index);
+
+struct device_s *registry_find_by_socket(const struct device_registry *reg,
+                                         int socket);
+
+// Also marks the device online
+int registry_bind_socket(struct device_registry *reg, struct device_s *device,
+                         int socket);
+
+// Also marks the device offline
+void registry_unbind_socket(struct device_registry *reg,
+                            struct device_s *device);
+
+void registry_set_online(struct device_registry *reg, struct device_s *device,
+                         int online);
+
+// Copies up to max ids of online devices, returns how many
+int registry_list_online(const struct device_registry *reg, uint32_t *ids,
+                         int max);
+
+#endif
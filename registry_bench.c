@@ -0,0 +1,155 @@
+/*
+
+Lookup and fleet scan cost of the device registry at 10k and 100k devices,
+against the previous layout: a hash table of pointers to individually
+allocated device structs, scanned through those pointers.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "registry.h"
+
+#define LOOKUPS 4000000
+#define SCANS 200
+
+// Previous layout, kept here as the baseline
+struct pointer_registry {
+  struct device_s **slots;
+  size_t capacity;
+  struct device_s **devices;
+  size_t count;
+};
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint32_t hash_id(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id;
+}
+
+struct device_s *pointer_find(const struct pointer_registry *reg, uint32_t id) {
+  size_t mask = reg->capacity - 1;
+  size_t i = hash_id(id) & mask;
+  while (reg->slots[i] && reg->slots[i]->id != id)
+    i = (i + 1) & mask;
+  return reg->slots[i];
+}
+
+void pointer_add(struct pointer_registry *reg, uint32_t id, int socket) {
+  size_t mask = reg->capacity - 1;
+  size_t i = hash_id(id) & mask;
+  while (reg->slots[i])
+    i = (i + 1) & mask;
+  // The previous struct also held the message buffers
+  struct device_s *device =
+      calloc(1, sizeof(*device) + sizeof(struct device_msgs));
+  device->id = id;
+  device->socket = socket;
+  reg->slots[i] = device;
+  reg->devices[reg->count++] = device;
+}
+
+int pointer_list_online(const struct pointer_registry *reg, uint32_t *ids,
+                        int max) {
+  int n = 0;
+  for (size_t i = 0; i < reg->count && n < max; i++)
+    if (reg->devices[i]->socket > -1)
+      ids[n++] = reg->devices[i]->id;
+  return n;
+}
+
+uint32_t random_id(void) { return (uint32_t)rand() << 16 ^ rand(); }
+
+int run(size_t device_count) {
+  uint32_t *ids = malloc(sizeof(*ids) * device_count);
+  uint32_t *order = malloc(sizeof(*order) * LOOKUPS);
+  uint32_t *online = malloc(sizeof(*online) * device_count);
+  struct device_registry reg;
+  struct pointer_registry old = {0};
+  if (!ids || !order || !online || registry_init(&reg, device_count * 2) < 0)
+    return -1;
+  old.capacity = reg.capacity;
+  old.slots = calloc(old.capacity, sizeof(*old.slots));
+  old.devices = malloc(sizeof(*old.devices) * device_count);
+  if (!old.slots || !old.devices)
+    return -1;
+
+  // Every other device online
+  for (size_t i = 0; i < device_count; i++) {
+    uint32_t id;
+    do
+      id = random_id();
+    while (registry_find(&reg, id));
+    ids[i] = id;
+    struct device_s *device = registry_add(&reg, id);
+    registry_set_online(&reg, device, i % 2 == 0);
+    pointer_add(&old, id, i % 2 == 0 ? (int)i : -1);
+  }
+  for (int i = 0; i < LOOKUPS; i++)
+    order[i] = ids[rand() % device_count];
+
+  size_t found = 0;
+  double start = now_sec();
+  for (int i = 0; i < LOOKUPS; i++)
+    found += pointer_find(&old, order[i]) != NULL;
+  double old_lookup = now_sec() - start;
+
+  start = now_sec();
+  for (int i = 0; i < LOOKUPS; i++)
+    found += registry_find(&reg, order[i]) != NULL;
+  double new_lookup = now_sec() - start;
+
+  int listed = 0;
+  start = now_sec();
+  for (int i = 0; i < SCANS; i++)
+    listed += pointer_list_online(&old, online, device_count);
+  double old_scan = now_sec() - start;
+
+  start = now_sec();
+  for (int i = 0; i < SCANS; i++)
+    listed -= registry_list_online(&reg, online, device_count);
+  double new_scan = now_sec() - start;
+
+  if (found != 2 * LOOKUPS || listed != 0) {
+    printf("Layouts disagree\n");
+    return -1;
+  }
+
+  printf("%zu devices\n", device_count);
+  printf("  lookup: pointer table %.1f ns, registry %.1f ns (%.2fx)\n",
+         old_lookup * 1e9 / LOOKUPS, new_lookup * 1e9 / LOOKUPS,
+         old_lookup / new_lookup);
+  printf("  scan:   pointer table %.1f us, registry %.1f us (%.2fx)\n",
+         old_scan * 1e6 / SCANS, new_scan * 1e6 / SCANS, old_scan / new_scan);
+
+  for (size_t i = 0; i < old.count; i++)
+    free(old.devices[i]);
+  free(old.devices);
+  free(old.slots);
+  registry_free(&reg);
+  free(online);
+  free(order);
+  free(ids);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  srand(1);
+  if (run(10000) < 0 || run(100000) < 0) {
+    printf("Failed\n");
+    return -1;
+  }
+  return 0;
+}
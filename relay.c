@@ -0,0 +1,61 @@
+#include <stdio.h>
+
+#include "hal.h"
+#include "relay.h"
+
+static enum hal_line relay_line(enum relay_action action) {
+  return action == RELAY_START ? HAL_NO : HAL_NC;
+}
+
+static void press(struct relay_pulser *relay, enum relay_action action) {
+  printf(action == RELAY_START ? "Starting motor\n" : "Stopping motor\n");
+  relay->active = action;
+  hal_set_line(relay_line(action), 1);
+  start_timer_ms(relay->pulse_ms, 0, &relay->timer);
+}
+
+static void release(struct relay_pulser *relay) {
+  hal_set_line(relay_line(relay->active), 0);
+  relay->active = RELAY_NONE;
+}
+
+static void on_pulse_end(void *data) {
+  struct relay_pulser *relay = data;
+  release(relay);
+  enum relay_action next = relay->pending;
+  relay->pending = RELAY_NONE;
+  if (next != RELAY_NONE)
+    press(relay, next);
+}
+
+int relay_init(struct relay_pulser *relay, struct event_loop *loop,
+               long pulse_ms) {
+  relay->pulse_ms = pulse_ms;
+  relay->active = RELAY_NONE;
+  relay->pending = RELAY_NONE;
+  return timer_init(&relay->timer, loop, on_pulse_end, relay);
+}
+
+void relay_request(struct relay_pulser *relay, enum relay_action action) {
+  // A stop drops a queued start, also when it merges into a running stop
+  if (action == RELAY_STOP)
+    relay->pending = RELAY_NONE;
+  if (action == RELAY_NONE || action == relay->active)
+    return;
+
+  if (action == RELAY_STOP) {
+    if (relay->active == RELAY_START) {
+      stop_timer(&relay->timer);
+      release(relay);
+    }
+    press(relay, RELAY_STOP);
+  } else if (relay->active == RELAY_STOP) {
+    relay->pending = RELAY_START;
+  } else {
+    press(relay, RELAY_START);
+  }
+}
+
+enum relay_action relay_intent(const struct relay_pulser *relay) {
+  return relay->pending != RELAY_NONE ? relay->pending : relay->active;
+}
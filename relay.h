@@ -0,0 +1,29 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "timer.h"
+
+enum relay_action { RELAY_NONE, RELAY_START, RELAY_STOP };
+
+/* Presses the start (NO) or stop (NC) button relay for pulse_ms without
+   blocking: the line is asserted, a timer releases it. Only one relay is
+   ever held. Overlapping requests are resolved so a stop always wins:
+   - the same action while it is held is merged into the running pulse
+   - stop during a start pulse cuts the start short and stops at once
+   - start during a stop pulse runs after it, unless a stop comes first */
+struct relay_pulser {
+  timer_w_t timer;
+  long pulse_ms;
+  enum relay_action active;  // Relay held right now
+  enum relay_action pending; // Pressed once active is released
+};
+
+int relay_init(struct relay_pulser *relay, struct event_loop *loop,
+               long pulse_ms);
+
+void relay_request(struct relay_pulser *relay, enum relay_action action);
+
+// Where the pulses in flight take the motor, RELAY_NONE when idle
+enum relay_action relay_intent(const struct relay_pulser *relay);
+
+#endif
@@ -6,177 +6,932 @@ https://docs.google.com/document/d/1qKUy8KDCigRU7vQpS-_mssLqFaAL-WPIdzxzrYwKAF0
 
 */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "aes/aes.h"
+#include "directory.h"
+#include "event_loop/event_loop.h"
+#include "event_loop/timer_wheel.h"
+#include "framing.h"
+#include "log.h"
+#include "mailbox.h"
+#include "outq.h"
+#include "registry.h"
 #include "server.h"
-#include "timer.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "telemetry.h"
 
 #define CLIENT_INACTIVE_SEC 60
+#define SERVER_TICK_MS 100
 
-struct device_s all_devices[MAX_DEVICES];
+#define C2_BATCH_MAX 256
+#define MAX_WORKERS 64
+#define OUTQ_DEFAULT_LIMIT (64 * 1024)
+#define SNAPSHOT_SYNC_MS 5000
 
-uint8_t deviceIdList[MAX_DEVICES] = {1, 2}; // Random IDs
+enum framing_mode { FRAMING_UNKNOWN, FRAMING_LEGACY, FRAMING_FRAMED };
 
-int client_sockets[MAX_CLIENTS];
+// What to do with a peer whose output queue is over outq_limit
+enum overflow_policy { OVERFLOW_DROP, OVERFLOW_DISCONNECT };
 
-void disconnect_client(union sigval sv);
+// Why a connection was closed, counted per reason
+enum disconnect_reason {
+  DISCONNECT_PEER,          // Orderly shutdown by the peer
+  DISCONNECT_READ_ERROR,
+  DISCONNECT_WRITE_ERROR,
+  DISCONNECT_CORRUPT_FRAME,
+  DISCONNECT_INACTIVE,      // Device sent no Msg A for inactive_sec
+  DISCONNECT_OVERFLOW,      // Output queue full under OVERFLOW_DISCONNECT
+  DISCONNECT_ERROR,         // Out of memory or event loop failure
+  DISCONNECT_REASONS
+};
 
-void init_device_list(struct device_s device_list[MAX_DEVICES]) {
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    device_list[i].id = deviceIdList[i];
-    device_list[i].socket = -1;
-  }
+// Message types plus one slot for unknown ones
+#define STATS_MSG_TYPES (MSG_TYPE_A2 + 2)
+
+/* Written only by the owning worker, read by the stats socket on worker 0
+   without locks, see stats.h. Rates are left to the reader, which diffs
+   the counters between two reports. */
+struct worker_stats {
+  stats_counter messages[STATS_MSG_TYPES];
+  stats_counter bytes_in;
+  stats_counter bytes_out;
+  stats_counter accepted;
+  stats_counter disconnects[DISCONNECT_REASONS];
+  stats_counter dropped;      // Messages discarded under OVERFLOW_DROP
+  stats_counter mail_sent;    // Posted to other workers' mailboxes
+  stats_counter mail_handled; // Taken from this worker's mailbox
+  stats_counter queued;       // Bytes in output queues, modulo 2^64
+  stats_counter queue_max;    // Deepest output queue seen, in bytes
+  struct stats_histogram handle[STATS_MSG_TYPES];
+  struct stats_histogram decrypt;
+  struct stats_histogram encrypt;
+  struct stats_histogram decrypt_batch; // One aes_ctx_*_batch call
+  struct stats_histogram encrypt_batch;
+  struct stats_histogram route_verify;
+  struct stats_histogram socket_read;
+  struct stats_histogram socket_write; // One outq_flush
+};
+
+struct connection {
+  int fd;
+  uint64_t id; // Unique per worker, guards against fd reuse
+  struct sockaddr_in address;
+  enum framing_mode framing;
+  struct frame_ring *rx; // Reassembly buffer, only for framed peers
+  struct outq out;
+  bool want_write; // EVENT_WRITE is registered while out could not drain
+  bool dirty;      // Listed in the worker's pending flushes
+  bool closing;    // Overflowed under OVERFLOW_DISCONNECT, closed on flush
+  bool subscribed; // Receives pushed D1 and D4, see MSG_TYPE_C4
+};
+
+struct pending_flush {
+  int fd;
+  uint64_t conn_id;
+};
+
+struct subscriber {
+  int fd;
+  uint64_t conn_id;
+};
+
+struct c2_frame {
+  uint8_t iv[AES_IV_LENGTH_BYTE];
+  uint8_t cipher[MSG_SIZE + MSG_SIZE];
+  uint8_t plain[MSG_SIZE + MSG_SIZE];
+  int out_socket;
+};
+
+enum mail_type {
+  MAIL_C1,     // D1 query for a device owned by the receiving worker
+  MAIL_C2,     // Decrypted C2 for a device owned by the receiving worker
+  MAIL_C2R,    // Encrypted Msg B to forward unchanged to the owner's device
+  MAIL_DELIVER, // Reply to send on one of the receiving worker's connections
+  MAIL_PUSH     // Update to queue for all of the receiving worker's subscribers
+};
+
+struct mail {
+  struct mail_node node; // First member, mail_node * casts back to mail *
+  enum mail_type type;
+  int reply_worker;
+  int reply_fd;
+  uint64_t reply_conn_id;
+  uint32_t device_id;
+  uint8_t iv[AES_IV_LENGTH_BYTE];
+  uint8_t buffer[AES_MSG_SIZE];
+  size_t len;
+  // MAIL_PUSH: the update encoded once, shared with every other recipient
+  struct out_buf *framed;
+  struct out_buf *legacy;
+};
+
+/* Everything a worker thread touches on its hot path. Each worker owns a
+   listening socket (SO_REUSEPORT), an event loop, a registry shard with
+   the devices connected to it and a mailbox for requests from other
+   workers. */
+struct worker {
+  int index;
+  pthread_t thread;
+  int listen_fd;
+  struct event_loop *loop;
+  // Inactivity timeouts of the worker's devices, expired on its loop thread
+  struct timer_wheel wheel;
+  struct device_registry registry;
+  // Connections indexed by socket fd. NULL if the fd is not a client socket
+  struct connection **connections;
+  int connections_cap;
+  uint64_t next_conn_id;
+  // C2 frames collected over one event loop wakeup when batch_crypto is set
+  struct c2_frame c2_batch[C2_BATCH_MAX];
+  int c2_batch_len;
+  struct mailbox mailbox;
+  // Connections queued output during this wakeup, flushed once at its end
+  struct pending_flush *pending;
+  int pending_len;
+  int pending_cap;
+  struct subscriber *subscribers;
+  int subscribers_len;
+  int subscribers_cap;
+  // subscribers_len for other workers, which skip us while it is zero
+  atomic_int subscriber_count;
+  struct worker_stats stats;
+};
+
+struct worker *workers;
+int worker_count = 1;
+__thread struct worker *self;
+
+// Which worker owns which device, only used with more than one worker
+struct device_directory directory;
+
+enum event_backend backend = EVENT_BACKEND_EPOLL;
+bool batch_crypto;
+size_t outq_limit = OUTQ_DEFAULT_LIMIT;
+enum overflow_policy overflow_policy = OVERFLOW_DROP;
+int inactive_sec = CLIENT_INACTIVE_SEC; // Above the devices' heartbeat
+
+// Mapped device state file, header is NULL unless -s is given
+struct device_snapshot snapshot;
+struct wheel_timer snapshot_timer;
+
+// Unix socket answering every connection with a stats report, see -S
+int stats_fd = -1;
+uint64_t start_time;
+
+const char *const message_names[STATS_MSG_TYPES] = {
+    "A", "B", "C0", "C1", "C2", "D0", "D1", "C2R", "C3", "D3", "C4", "D4",
+    "A1", "A2", "unknown"};
+const char *const disconnect_names[DISCONNECT_REASONS] = {
+    "peer", "read_error", "write_error", "corrupt_frame",
+    "inactive", "overflow", "error"};
+
+void disconnect_client(struct wheel_timer *timer, void *data);
+
+void flush_c2_batch(void);
+
+void publish(const uint8_t *payload, size_t len);
+
+void publish_online(uint32_t device_id, bool online) {
+  uint8_t update[D4_SIZE] = {MSG_TYPE_D4, device_id, online};
+  publish(update, sizeof(update));
 }
 
-void rand_device_list(struct device_s device_list[MAX_DEVICES]) {
-  for (int i = 0; i < 2; i++) {
-    struct device_s *d = device_list + i;
-    d->id = 1 + i;
-    d->rem_cut_off_time = 45;
+// Copies a device's state into its snapshot record, if it has one
+// Message buffers of a device in this worker's registry
+struct device_msgs *device_msgs(const struct device_s *device) {
+  return registry_msgs(&self->registry, device->index);
+}
+
+void save_device(const struct device_s *device) {
+  struct snapshot_record *record = device->snapshot;
+  if (!record)
+    return;
+  record->online = device->socket > -1 || device->restored;
+  record->rem_cut_off_time = device->rem_cut_off_time;
+  record->set_cut_off_time = device->set_cut_off_time;
+  record->last_seen = device->last_seen;
+  memcpy(record->msg_A_buf, device_msgs(device)->msg_A_buf, MSG_SIZE);
+  memcpy(record->msg_C2_buf, device_msgs(device)->msg_C2_buf, MSG_SIZE);
+}
+
+// Decodes the fields of a Msg A into the device, without keeping the buffer
+void parse_msg_A(struct device_s *device, const char in_buffer[MSG_SIZE]) {
+  struct msg_A_fields fields;
+  msg_A_unpack((const uint8_t *)in_buffer, &fields);
+  device->passcode = fields.passcode;
+  device->last_rssi = fields.rssi;
+  device->adc_0 = fields.adc[0];
+  device->adc_1 = fields.adc[1];
+  device->adc_2 = fields.adc[2];
+  device->adc_3 = fields.adc[3];
+  device->rem_cut_off_time = fields.rem_cut_off_time;
+  device->gpio_states = fields.gpio;
+}
+
+// Binds the device to in_socket and arms its inactivity timeout
+struct device_s *device_seen(const int in_socket, uint8_t device_id) {
+  struct device_s *current_device = registry_add(&self->registry, device_id);
+  if (current_device == NULL)
+    return NULL;
+
+  if (current_device->socket != in_socket) {
+    // Fresh connection or reconnect on a new socket
+    registry_bind_socket(&self->registry, current_device, in_socket);
+    current_device->restored = false;
+    // A restored device or one still on its old socket has a running timer
+    if (!wheel_timer_pending(&current_device->device_connection_timer))
+      wheel_timer_init(&current_device->device_connection_timer,
+                       disconnect_client, current_device);
+    if (worker_count > 1)
+      directory_set_online(&directory, device_id, self->index);
+    publish_online(device_id, true);
   }
+  // Disconnects the client after inactivity. Pushed back lazily from
+  // last_seen when it fires, not on every message
+  if (!wheel_timer_pending(&current_device->device_connection_timer))
+    timer_wheel_schedule(&self->wheel,
+                         &current_device->device_connection_timer,
+                         inactive_sec * 1000);
+  return current_device;
+}
+
+// Appends the device's current telemetry to its history at time
+void record_sample(struct device_s *device, const char msg_A[MSG_SIZE],
+                   uint32_t time) {
+  if (!device->history)
+    device->history = directory_history(&directory, device->id);
+  if (!device->history)
+    return;
+  struct msg_A_fields fields;
+  msg_A_unpack((const uint8_t *)msg_A, &fields);
+  struct telemetry_sample sample = {
+      time,
+      {fields.adc[0], fields.adc[1], fields.adc[2], fields.adc[3]},
+      fields.rssi,
+      fields.gpio};
+  history_append(device->history, &sample);
+}
+
+// Saves the device and pushes its last Msg A to subscribers as a D1
+void publish_device(struct device_s *device) {
+  if (snapshot.header && !device->snapshot)
+    device->snapshot = snapshot_record(&snapshot, device->id);
+  save_device(device);
+
+  uint8_t update[MSG_SIZE];
+  memcpy(update, device_msgs(device)->msg_A_buf, MSG_SIZE);
+  update[0] = MSG_TYPE_D1;
+  publish(update, sizeof(update));
 }
 
 void store_data(const int in_socket, const char in_buffer[MSG_SIZE]) {
-  struct device_s *current_device = NULL;
-  int device_idx;
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    int current_device_id = all_devices[i].id;
-    if (current_device_id == in_buffer[3]) {
-      current_device = &all_devices[i];
-      device_idx = i;
-      break;
-    }
-  }
+  struct device_s *current_device = device_seen(in_socket, in_buffer[3]);
+  if (current_device == NULL)
+    return;
+  LOG_DEBUG("storing device id %lu\n", current_device->id);
+  parse_msg_A(current_device, in_buffer);
+  memcpy(device_msgs(current_device)->msg_A_buf, in_buffer, MSG_SIZE);
+  current_device->last_seen = time(NULL);
+  record_sample(current_device, in_buffer, current_device->last_seen);
+  publish_device(current_device);
+}
 
+// Takes a sample taken at the given time into the device state and history
+void store_sample(struct device_s *device, const char msg_A[MSG_SIZE],
+                  time_t taken) {
+  parse_msg_A(device, msg_A);
+  memcpy(device_msgs(device)->msg_A_buf, msg_A, MSG_SIZE);
+  record_sample(device, msg_A, taken);
+}
+
+/* Msg A1: samples buffered by the device while it was offline. They only
+   go into the history, which drops those older than its newest sample, so
+   a batch resent after a dropped upload is not stored twice. The live
+   state, subscribers and snapshot wait for the fresh Msg A that follows. */
+void store_batch(const int in_socket, const uint8_t in_buffer[AES_MSG_SIZE]) {
+  int count = in_buffer[MSG_A1_COUNT_IDX];
+  if (count == 0 || count > MSG_A1_MAX_SAMPLES)
+    return;
+  struct device_s *current_device = device_seen(in_socket, in_buffer[3]);
   if (current_device == NULL)
     return;
+  LOG_DEBUG("storing %ld buffered samples of device id %lu\n", count,
+            current_device->id);
 
-  if (current_device->socket == -1) {
-    // Fresh connection. start timer to disconnecting client after inactivity
-    current_device->socket = in_socket;
-    start_timer(CLIENT_INACTIVE_SEC, 0, disconnect_client,
-                &current_device->device_connection_timer, device_idx);
-  } else {
-    adjust_timer(CLIENT_INACTIVE_SEC, 0,
-                 &current_device->device_connection_timer);
+  time_t now = time(NULL);
+  for (int i = 0; i < count; i++) {
+    char msg_A[MSG_SIZE];
+    uint32_t age = msg_A1_sample(in_buffer, i, (uint8_t *)msg_A);
+    record_sample(current_device, msg_A, age < now ? now - age : 0);
   }
-  int idx = 1;
-  current_device->passcode = *((int16_t *)(in_buffer + idx));
-  idx += 2;
-  current_device->id = in_buffer[idx];
-  printf("storing device id %d\n", current_device->id);
-  idx++;
-  current_device->last_rssi = in_buffer[idx];
-  idx++;
+  current_device->last_seen = now;
+}
 
-  idx += 5; // Skipping ADC for now
-  current_device->rem_cut_off_time = *((int16_t *)(in_buffer + idx));
-  idx += 2;
-  current_device->gpio_states = in_buffer[idx];
-  memcpy(current_device->msg_A_buf, in_buffer, sizeof(char) * MSG_SIZE);
+/* Msg A2: bit-packed samples, each stored as if it came in a Msg A. in_len
+   is the number of bytes received, a truncated A2 is dropped */
+void store_packed(const int in_socket, const uint8_t in_buffer[AES_MSG_SIZE],
+                  size_t in_len) {
+  struct msg_A2_fields packed;
+  if (msg_A2_unpack(in_buffer, in_len, &packed) < 0)
+    return;
+  struct device_s *current_device =
+      device_seen(in_socket, packed.device_id);
+  if (current_device == NULL)
+    return;
+  LOG_DEBUG("storing %ld packed samples of device id %lu\n", packed.count,
+            current_device->id);
+
+  struct msg_A_fields fields = {packed.passcode, packed.device_id, packed.rssi,
+                                {0}, packed.rem_cut_off_time, packed.gpio};
+  time_t now = time(NULL);
+  time_t last = now - packed.age;
+  for (int i = 0; i < packed.count; i++) {
+    char msg_A[MSG_SIZE];
+    memcpy(fields.adc, packed.adc[i], sizeof(fields.adc));
+    msg_A_pack((uint8_t *)msg_A, &fields);
+    store_sample(current_device, msg_A,
+                 last - (time_t)(packed.count - 1 - i) * packed.interval);
+  }
+  current_device->last_seen = now;
+  publish_device(current_device);
 }
 
 void get_device_list(char out_buffer[MSG_SIZE]) {
   memset(out_buffer, 0, sizeof(char) * MSG_SIZE);
   int device_cnt = 0;
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    int current_device_id = all_devices[i].id;
-    if (all_devices[i].socket > -1) {
-      out_buffer[device_cnt + 2] = current_device_id;
-      device_cnt++;
-    }
+  uint32_t ids[MSG_SIZE - 2];
+  if (worker_count > 1) {
+    // Devices are spread over all shards, the directory sees every one
+    device_cnt = directory_list_online(&directory, ids, MSG_SIZE - 2);
+  } else {
+    device_cnt = registry_list_online(&self->registry, ids, MSG_SIZE - 2);
   }
+  for (int i = 0; i < device_cnt; i++)
+    out_buffer[i + 2] = ids[i];
 
   out_buffer[0] = MSG_TYPE_D0;
   out_buffer[1] = device_cnt;
-  printf("dev cnt %d\n", device_cnt);
+  LOG_DEBUG("dev cnt %ld\n", device_cnt);
 }
 
 int get_device_buffer(int device_id, char out_buffer[MSG_SIZE],
                       enum message_types msg_type) {
-  printf("got device id %d\n", device_id);
+  LOG_DEBUG("got device id %ld\n", device_id);
   memset(out_buffer, 0, sizeof(char) * MSG_SIZE);
-  struct device_s *device;
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    device = &all_devices[i];
-    if (device->id == device_id) { /* Msg A and D1; B and C2 are relayed between
-                                      device and user. So it is just copied */
-      printf("found device\n");
-      if (msg_type == MSG_TYPE_D1)
-        memcpy(out_buffer, device->msg_A_buf, sizeof(char) * MSG_SIZE);
-      else if (msg_type == MSG_TYPE_B)
-        memcpy(out_buffer, device->msg_C2_buf, sizeof(char) * MSG_SIZE);
-      break;
-    }
+  struct device_s *device = registry_find(&self->registry, device_id);
+  if (device) { /* Msg A and D1; B and C2 are relayed between
+                   device and user. So it is just copied */
+    LOG_DEBUG("found device\n");
+    if (msg_type == MSG_TYPE_D1)
+      memcpy(out_buffer, device_msgs(device)->msg_A_buf, MSG_SIZE);
+    else if (msg_type == MSG_TYPE_B)
+      memcpy(out_buffer, device_msgs(device)->msg_C2_buf, MSG_SIZE);
   }
   out_buffer[0] = msg_type;
 #ifdef DEBUG_PRINT
   for (int i = 0; i < 16; i++)
     printf("%d:%d\n", i, out_buffer[i]);
 #endif
-  return device->socket;
+  return device ? device->socket : -1;
 }
 
 void set_device_buffer(int device_id, const char in_buffer[MSG_SIZE]) {
-  struct device_s *device;
-  for (int i = 0; i < MAX_DEVICES; i++) {
-    device = &all_devices[i];
-    if (device->id == device_id) {
-      memcpy(device->msg_C2_buf, in_buffer, sizeof(char) * MSG_SIZE);
+  struct device_s *device = registry_find(&self->registry, device_id);
+  if (device) {
+    memcpy(device_msgs(device)->msg_C2_buf, in_buffer, MSG_SIZE);
+    save_device(device);
+  }
+}
+
+// Worker whose shard holds the device's live connection
+int device_owner(uint32_t device_id) {
+  if (worker_count == 1)
+    return self->index;
+  struct device_s *device = registry_find(&self->registry, device_id);
+  if (device && device->socket > -1)
+    return self->index;
+  int owner = directory_owner(&directory, device_id);
+  return owner > -1 ? owner : self->index;
+}
+
+void post_mail(int worker_index, struct mail *mail) {
+  stats_add(&self->stats.mail_sent, 1);
+  mailbox_post(&workers[worker_index].mailbox, &mail->node);
+}
+
+struct connection *find_connection(int fd) {
+  if (fd < 0 || fd >= self->connections_cap)
+    return NULL;
+  return self->connections[fd];
+}
+
+struct connection *open_connection(int fd, const struct sockaddr_in *address) {
+  if (fd >= self->connections_cap) {
+    int cap = self->connections_cap ? self->connections_cap : 64;
+    while (cap <= fd)
+      cap *= 2;
+    struct connection **grown =
+        realloc(self->connections, sizeof(*self->connections) * cap);
+    if (!grown)
+      return NULL;
+    memset(grown + self->connections_cap, 0,
+           sizeof(*self->connections) * (cap - self->connections_cap));
+    self->connections = grown;
+    self->connections_cap = cap;
+  }
+  // A slot in pending for every possible connection, so queueing never fails
+  if (self->pending_cap < self->connections_cap) {
+    struct pending_flush *grown = realloc(
+        self->pending, sizeof(*self->pending) * self->connections_cap);
+    if (!grown)
+      return NULL;
+    self->pending = grown;
+    self->pending_cap = self->connections_cap;
+  }
+
+  struct connection *conn = calloc(1, sizeof(*conn));
+  if (!conn)
+    return NULL;
+  conn->fd = fd;
+  conn->id = self->next_conn_id++;
+  conn->address = *address;
+  self->connections[fd] = conn;
+  return conn;
+}
+
+void subscribe(struct connection *conn) {
+  if (conn->subscribed)
+    return;
+  if (self->subscribers_len == self->subscribers_cap) {
+    int cap = self->subscribers_cap ? self->subscribers_cap * 2 : 16;
+    struct subscriber *grown =
+        realloc(self->subscribers, sizeof(*self->subscribers) * cap);
+    if (!grown)
+      return;
+    self->subscribers = grown;
+    self->subscribers_cap = cap;
+  }
+  self->subscribers[self->subscribers_len++] =
+      (struct subscriber){conn->fd, conn->id};
+  conn->subscribed = true;
+  atomic_store(&self->subscriber_count, self->subscribers_len);
+}
+
+void unsubscribe(struct connection *conn) {
+  if (!conn->subscribed)
+    return;
+  for (int i = 0; i < self->subscribers_len; i++) {
+    if (self->subscribers[i].conn_id == conn->id) {
+      self->subscribers[i] = self->subscribers[--self->subscribers_len];
       break;
     }
   }
+  conn->subscribed = false;
+  atomic_store(&self->subscriber_count, self->subscribers_len);
 }
 
-void disconnect_client(union sigval sv) {
+void device_offline(struct device_s *device) {
+  timer_wheel_cancel(&self->wheel, &device->device_connection_timer);
+  registry_unbind_socket(&self->registry, device);
+  device->restored = false;
+  if (worker_count > 1) {
+    directory_set_offline(&directory, device->id, self->index);
+    // Another worker may hold the device by now, its record is current
+    if (directory_owner(&directory, device->id) > -1)
+      return;
+  }
+  save_device(device);
+  publish_online(device->id, false);
+}
 
-  struct sockaddr_in address;
-  int addrlen = sizeof(address);
-  int dev_idx = sv.sival_int;
-  int socket = all_devices[dev_idx].socket;
-  timer_delete(all_devices[dev_idx].device_connection_timer);
-  getpeername(socket, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-  printf("Host disconnected, ip %s, port %d\n", inet_ntoa(address.sin_addr),
-         ntohs(address.sin_port));
-  close(socket);
-  all_devices[dev_idx].socket = -1;
-  // Find client in client_sockets list
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (client_sockets[i] == socket) {
-      client_sockets[i] = -1;
-      break;
+void unmark_pending(struct connection *conn) {
+  for (int i = 0; i < self->pending_len; i++) {
+    if (self->pending[i].conn_id == conn->id) {
+      self->pending[i] = self->pending[--self->pending_len];
+      return;
     }
   }
 }
 
+void close_connection(struct connection *conn,
+                      enum disconnect_reason reason) {
+  struct device_s *device =
+      registry_find_by_socket(&self->registry, conn->fd);
+  if (device)
+    device_offline(device);
+  unsubscribe(conn);
+  stats_add(&self->stats.disconnects[reason], 1);
+  stats_add(&self->stats.queued, -conn->out.bytes);
+  if (conn->dirty)
+    unmark_pending(conn);
+  printf("Host disconnected, ip %s, port %d\n",
+         inet_ntoa(conn->address.sin_addr), ntohs(conn->address.sin_port));
+  event_loop_remove(self->loop, conn->fd);
+  close(conn->fd);
+  self->connections[conn->fd] = NULL;
+  outq_free(&conn->out);
+  free(conn->rx);
+  free(conn);
+}
+
+void disconnect_client(struct wheel_timer *timer, void *data) {
+  struct device_s *device = data;
+  // Heard from since the timer was armed
+  time_t idle = time(NULL) - device->last_seen;
+  if (!device->restored && idle >= 0 && idle < inactive_sec) {
+    timer_wheel_schedule(&self->wheel, timer, (inactive_sec - idle) * 1000);
+    return;
+  }
+  struct connection *conn = find_connection(device->socket);
+  if (conn)
+    close_connection(conn, DISCONNECT_INACTIVE);
+  else
+    device_offline(device);
+}
+
+/* Stores a decrypted C2 for its device and turns decData into the Msg B
+   plaintext. Returns the device socket or -1. A C2 for a device owned by
+   another worker is handed to it through its mailbox and -1 returned. */
+int relay_msg_C2(uint8_t decData[MSG_SIZE],
+                 const uint8_t iv[AES_IV_LENGTH_BYTE]) {
+  int device_id = decData[3];
+#ifdef DEBUG_PRINT
+  for (int i = 0; i < 16; i++)
+    printf("%d:%d\n", i, decData[i]);
+#endif
+  int owner = device_owner(device_id);
+  if (owner != self->index) {
+    struct mail *mail = calloc(1, sizeof(*mail));
+    if (!mail)
+      return -1;
+    mail->type = MAIL_C2;
+    memcpy(mail->iv, iv, AES_IV_LENGTH_BYTE);
+    memcpy(mail->buffer, decData, MSG_SIZE);
+    post_mail(owner, mail);
+    return -1;
+  }
+  set_device_buffer(device_id, decData);
+  return get_device_buffer(device_id, decData, MSG_TYPE_B);
+}
+
+/* pending holds open connections only, at most one entry each, and
+   open_connection sized it for all of them */
+void mark_pending(struct connection *conn) {
+  if (conn->dirty)
+    return;
+  self->pending[self->pending_len++] =
+      (struct pending_flush){conn->fd, conn->id};
+  conn->dirty = true;
+}
+
+// Appends buf to the connection's output queue, enforcing outq_limit
+void queue_message(struct connection *conn, struct out_buf *buf) {
+  if (conn->closing)
+    return;
+  if (conn->out.bytes + buf->len > outq_limit) {
+    if (overflow_policy == OVERFLOW_DROP) {
+      stats_add(&self->stats.dropped, 1);
+      LOG_WARN("Output queue of socket %ld full, dropping %lu bytes\n",
+               conn->fd, buf->len);
+      return;
+    }
+    LOG_WARN("Output queue of socket %ld full, disconnecting\n", conn->fd);
+    stats_add(&self->stats.queued, -conn->out.bytes);
+    outq_free(&conn->out);
+    conn->closing = true;
+  } else if (outq_push(&conn->out, buf) < 0) {
+    LOG_ERROR("Out of memory queueing for socket %ld\n", conn->fd);
+    return;
+  } else {
+    stats_add(&self->stats.queued, buf->len);
+    if (conn->out.bytes > stats_read(&self->stats.queue_max))
+      atomic_store_explicit(&self->stats.queue_max, conn->out.bytes,
+                            memory_order_relaxed);
+  }
+  mark_pending(conn);
+}
+
+// Wire form of a message of len <= AES_MSG_SIZE bytes for the given framing
+struct out_buf *encode_message(enum framing_mode framing,
+                               const uint8_t *payload, size_t len) {
+  uint8_t data[FRAME_HEADER_SIZE + AES_MSG_SIZE] = {0};
+  if (framing == FRAMING_FRAMED)
+    return out_buf_new(data, frame_encode(data, payload, len));
+  memcpy(data, payload, len);
+  return out_buf_new(data, AES_MSG_SIZE);
+}
+
+/* Framed peers get exactly len bytes in one frame, legacy peers always get
+   the full AES_MSG_SIZE buffer. The message is queued and written once the
+   current wakeup is done, so replies to one peer go out in one sendmsg */
+void send_message(int send_socket, const uint8_t out_buffer[AES_MSG_SIZE],
+                  size_t len) {
+  struct connection *conn = find_connection(send_socket);
+  if (!conn) {
+    LOG_WARN("Could not send data to socket %ld\n", send_socket);
+    return;
+  }
+  struct out_buf *buf = encode_message(conn->framing, out_buffer, len);
+  if (!buf)
+    return;
+  queue_message(conn, buf);
+  out_buf_unref(buf);
+}
+
+/* Writes as much of the output queue as the socket takes and keeps
+   EVENT_WRITE registered only while something is left. Returns -1 if the
+   connection was closed */
+int flush_connection(struct connection *conn) {
+  if (conn->closing) {
+    close_connection(conn, DISCONNECT_OVERFLOW);
+    return -1;
+  }
+  size_t queued = conn->out.bytes;
+  uint64_t start = stats_now();
+  int drained = outq_flush(&conn->out, conn->fd);
+  stats_record_since(&self->stats.socket_write, start);
+  stats_add(&self->stats.bytes_out, queued - conn->out.bytes);
+  stats_add(&self->stats.queued, conn->out.bytes - queued);
+  if (drained < 0) {
+    close_connection(conn, DISCONNECT_WRITE_ERROR);
+    return -1;
+  }
+  if (conn->want_write != !drained) {
+    conn->want_write = !drained;
+    event_loop_modify(self->loop, conn->fd,
+                      EVENT_READ | (conn->want_write ? EVENT_WRITE : 0));
+  }
+  return 0;
+}
+
+// Queues an update for every subscriber of this worker
+void push_to_subscribers(struct out_buf *framed, struct out_buf *legacy) {
+  for (int i = 0; i < self->subscribers_len; i++) {
+    struct connection *conn = find_connection(self->subscribers[i].fd);
+    if (conn && conn->id == self->subscribers[i].conn_id)
+      queue_message(conn, conn->framing == FRAMING_FRAMED ? framed : legacy);
+  }
+}
+
+/* Sends an update to all subscribers. It is encoded once per framing and
+   the same buffers are queued on every subscriber, across all workers */
+void publish(const uint8_t *payload, size_t len) {
+  struct out_buf *framed = NULL;
+  struct out_buf *legacy = NULL;
+  for (int w = 0; w < worker_count; w++) {
+    if (atomic_load_explicit(&workers[w].subscriber_count,
+                             memory_order_relaxed) == 0)
+      continue;
+    if (!framed) {
+      framed = encode_message(FRAMING_FRAMED, payload, len);
+      legacy = encode_message(FRAMING_LEGACY, payload, len);
+      if (!framed || !legacy)
+        break;
+    }
+    if (w == self->index) {
+      push_to_subscribers(framed, legacy);
+      continue;
+    }
+    struct mail *mail = calloc(1, sizeof(*mail));
+    if (!mail)
+      continue;
+    mail->type = MAIL_PUSH;
+    mail->framed = out_buf_ref(framed);
+    mail->legacy = out_buf_ref(legacy);
+    post_mail(w, mail);
+  }
+  out_buf_unref(framed);
+  out_buf_unref(legacy);
+}
+
+void flush_pending(void) {
+  for (int i = 0; i < self->pending_len; i++) {
+    struct connection *conn = find_connection(self->pending[i].fd);
+    // Skip connections closed, and their fd reused, since they were queued
+    if (!conn || conn->id != self->pending[i].conn_id)
+      continue;
+    conn->dirty = false;
+    flush_connection(conn);
+  }
+  self->pending_len = 0;
+}
+
+uint32_t read_le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void write_le32(uint8_t *p, uint32_t value) {
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = (value >> 24) & 0xFF;
+}
+
+/* Answers a C3 with as many D3 as the samples need. Histories are shared by
+   all workers, so this never has to go through the owner's mailbox */
+void send_history(int out_socket, const uint8_t in_buffer[AES_MSG_SIZE]) {
+  uint8_t device_id = in_buffer[C3_DEVICE_IDX];
+  uint32_t from = read_le32(in_buffer + C3_FROM_IDX);
+  uint32_t to = read_le32(in_buffer + C3_TO_IDX);
+  uint16_t resolution =
+      in_buffer[C3_RESOLUTION_IDX] | in_buffer[C3_RESOLUTION_IDX + 1] << 8;
+
+  struct telemetry_sample samples[C3_MAX_SAMPLES];
+  int count = 0;
+  struct telemetry_history *history =
+      directory_find_history(&directory, device_id);
+  if (history)
+    count = history_query(history, from, to, resolution, samples,
+                          C3_MAX_SAMPLES);
+  LOG_DEBUG("History of device %ld: %ld samples\n", device_id, count);
+
+  int sent = 0;
+  do {
+    uint8_t out_buffer[AES_MSG_SIZE] = {0};
+    int n = count - sent < D3_MAX_SAMPLES ? count - sent : D3_MAX_SAMPLES;
+    out_buffer[0] = MSG_TYPE_D3;
+    out_buffer[1] = device_id;
+    out_buffer[2] = n;
+    out_buffer[3] = sent + n < count;
+    uint8_t *p = out_buffer + D3_HEADER_SIZE;
+    for (int i = sent; i < sent + n; i++) {
+      write_le32(p, samples[i].time);
+      p += 4;
+      for (int ch = 0; ch < HISTORY_ADC_CHANNELS; ch++) {
+        *p++ = samples[i].adc[ch] & 0xFF;
+        *p++ = samples[i].adc[ch] >> 8;
+      }
+      *p++ = samples[i].rssi;
+      *p++ = samples[i].gpio;
+    }
+    send_message(out_socket, out_buffer, p - out_buffer);
+    sent += n;
+  } while (sent < count);
+}
+
+/* Records the Msg B of a C2R for its device, as relay_msg_C2 does for a C2,
+   so C1 and the snapshot see it. The ciphertext is only decrypted, it is
+   forwarded as is. Returns -1 if it is not a Msg B for device_id */
+int record_msg_C2R(uint32_t device_id, const uint8_t *iv_cipher) {
+  unsigned char key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint8_t decData[MSG_SIZE + MSG_SIZE];
+  uint64_t start = stats_now();
+  int dec_len = aes_ctx_decrypt(aes_thread_ctx(key),
+                                iv_cipher + AES_IV_LENGTH_BYTE,
+                                MSG_SIZE + MSG_SIZE, iv_cipher, decData);
+  stats_record_since(&self->stats.decrypt, start);
+  if (dec_len != MSG_SIZE || decData[3] != device_id)
+    return -1;
+  set_device_buffer(device_id, (const char *)decData);
+  return 0;
+}
+
+/* Checks the routing tag of a C2R and passes its IV and ciphertext on
+   unchanged. Returns the device socket with the Msg B in out_buffer, or -1
+   if it was rejected or handed to the owning worker */
+int forward_msg_C2R(const uint8_t in_buffer[AES_MSG_SIZE],
+                    uint8_t out_buffer[AES_MSG_SIZE], size_t *out_len) {
+  unsigned char key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  uint64_t start = stats_now();
+  bool valid = aes_ctx_route_verify(aes_thread_ctx(key), in_buffer,
+                                    C2R_TAG_IDX, in_buffer + C2R_TAG_IDX);
+  stats_record_since(&self->stats.route_verify, start);
+  if (!valid) {
+    LOG_WARN("Dropping C2R with bad routing tag\n");
+    return -1;
+  }
+
+  int device_id = in_buffer[C2R_DEVICE_IDX];
+  size_t len = C2R_TAG_IDX - C2R_IV_IDX;
+  int owner = device_owner(device_id);
+  if (owner != self->index) {
+    struct mail *mail = calloc(1, sizeof(*mail));
+    if (!mail)
+      return -1;
+    mail->type = MAIL_C2R;
+    mail->device_id = device_id;
+    memcpy(mail->buffer, in_buffer + C2R_IV_IDX, len);
+    mail->len = len;
+    post_mail(owner, mail);
+    return -1;
+  }
+
+  struct device_s *device = registry_find(&self->registry, device_id);
+  if (!device || record_msg_C2R(device_id, in_buffer + C2R_IV_IDX) < 0)
+    return -1;
+  memcpy(out_buffer, in_buffer + C2R_IV_IDX, len);
+  *out_len = len;
+  return device->socket;
+}
+
+void queue_msg_C2(const uint8_t in_buffer[AES_MSG_SIZE]) {
+  if (self->c2_batch_len == C2_BATCH_MAX)
+    flush_c2_batch();
+  struct c2_frame *frame = &self->c2_batch[self->c2_batch_len++];
+  memcpy(frame->iv, in_buffer + 1, AES_IV_LENGTH_BYTE);
+  memcpy(frame->cipher, in_buffer + 1 + AES_IV_LENGTH_BYTE,
+         sizeof(frame->cipher));
+}
+
+/* Decrypts every queued C2 in one batch call, then encrypts all resulting
+   Msg Bs in another and sends them */
+void flush_c2_batch(void) {
+  struct c2_frame *c2_batch = self->c2_batch;
+  int c2_batch_len = self->c2_batch_len;
+  if (c2_batch_len == 0)
+    return;
+
+  unsigned char key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  aes_ctx_t *aes = aes_thread_ctx(key);
+  struct aes_frame frames[C2_BATCH_MAX];
+  struct c2_frame *relayed[C2_BATCH_MAX];
+
+  for (int i = 0; i < c2_batch_len; i++) {
+    struct c2_frame *frame = &c2_batch[i];
+    frames[i] = (struct aes_frame){frame->iv, frame->cipher,
+                                   sizeof(frame->cipher), frame->plain, 0};
+  }
+  uint64_t start = stats_now();
+  size_t decrypted = aes_ctx_decrypt_batch(aes, frames, c2_batch_len);
+  stats_record_since(&self->stats.decrypt_batch, start);
+
+  int relay_cnt = 0;
+  for (int i = 0; decrypted && i < c2_batch_len; i++) {
+    struct c2_frame *frame = &c2_batch[i];
+    // A shorter plaintext would relay what an earlier C2 left in plain
+    if (frames[i].out_len != MSG_SIZE)
+      continue;
+    frame->out_socket = relay_msg_C2(frame->plain, frame->iv);
+    if (frame->out_socket < 0)
+      continue;
+    frames[relay_cnt] = (struct aes_frame){frame->iv, frame->plain, MSG_SIZE,
+                                           frame->cipher, 0};
+    relayed[relay_cnt++] = frame;
+  }
+  start = stats_now();
+  size_t encrypted = aes_ctx_encrypt_batch(aes, frames, relay_cnt);
+  stats_record_since(&self->stats.encrypt_batch, start);
+
+  uint8_t out_buffer[AES_MSG_SIZE];
+  for (int i = 0; encrypted && i < relay_cnt; i++) {
+    if (frames[i].out_len < 0)
+      continue;
+    memset(out_buffer, 0, sizeof(out_buffer));
+    memcpy(out_buffer, relayed[i]->iv, AES_IV_LENGTH_BYTE);
+    memcpy(out_buffer + AES_IV_LENGTH_BYTE, relayed[i]->cipher,
+           frames[i].out_len);
+    send_message(relayed[i]->out_socket, out_buffer,
+                 AES_IV_LENGTH_BYTE + frames[i].out_len);
+  }
+  self->c2_batch_len = 0;
+}
+
 int handle_client_message(const int in_socket,
-                          const uint8_t in_buffer[AES_MSG_SIZE],
-                          uint8_t out_buffer[AES_MSG_SIZE]) {
+                          const uint8_t in_buffer[AES_MSG_SIZE], size_t in_len,
+                          uint8_t out_buffer[AES_MSG_SIZE], size_t *out_len) {
   enum message_types msg_type = in_buffer[MSG_TYPE_IDX];
-  printf("Msg type %d\n", msg_type);
+  LOG_DEBUG("Msg type %ld\n", msg_type);
   int out_socket = -1;
   int device_id;
 
   switch (msg_type) {
   case MSG_TYPE_A:
-    printf("Got msg A\n");
+    LOG_DEBUG("Got msg A\n");
     store_data(in_socket, in_buffer);
     break;
 
+  case MSG_TYPE_A1:
+    LOG_DEBUG("Got msg A1\n");
+    store_batch(in_socket, in_buffer);
+    break;
+
+  case MSG_TYPE_A2:
+    LOG_DEBUG("Got msg A2\n");
+    store_packed(in_socket, in_buffer, in_len);
+    break;
+
   case MSG_TYPE_C0:
-    // rand_device_list(all_devices);
     get_device_list(out_buffer);
+    *out_len = MSG_SIZE;
     unsigned int passcode = *((uint16_t *)(in_buffer + 1));
-    printf("Received passcode %d\n", passcode);
+    LOG_DEBUG("Received passcode %lu\n", passcode);
     if (passcode == CLIENT_PASSCODE) {
-      printf("Responding to client\n");
+      LOG_DEBUG("Responding to client\n");
       out_socket = in_socket;
     } else {
       out_socket = -1;
@@ -185,63 +940,516 @@ int handle_client_message(const int in_socket,
 
   case MSG_TYPE_C1:
     device_id = in_buffer[1];
+    int owner = device_owner(device_id);
+    if (owner != self->index) {
+      // The owner answers through our mailbox
+      struct connection *conn = find_connection(in_socket);
+      struct mail *mail = calloc(1, sizeof(*mail));
+      if (!conn || !mail) {
+        free(mail);
+        break;
+      }
+      mail->type = MAIL_C1;
+      mail->reply_worker = self->index;
+      mail->reply_fd = in_socket;
+      mail->reply_conn_id = conn->id;
+      memcpy(mail->buffer, in_buffer, MSG_SIZE);
+      post_mail(owner, mail);
+      break;
+    }
     get_device_buffer(device_id, out_buffer, MSG_TYPE_D1);
+    *out_len = MSG_SIZE;
     out_socket = in_socket;
     break;
 
   case MSG_TYPE_C2:
+    if (batch_crypto) {
+      queue_msg_C2(in_buffer);
+      break;
+    }
     unsigned char iv[AES_IV_LENGTH_BYTE];
     memcpy(iv, in_buffer + 1, AES_IV_LENGTH_BYTE);
     unsigned char key[AES_KEY_LENGTH_BYTE] = AES_KEY;
 
-    uint8_t decData[MSG_SIZE];
+    aes_ctx_t *aes = aes_thread_ctx(key);
+
+    uint8_t decData[MSG_SIZE + MSG_SIZE];
     memset(decData, 0, sizeof(decData));
-    decryptAES(in_buffer + 1 + AES_IV_LENGTH_BYTE, MSG_SIZE, (uint8_t *)key,
-               (uint8_t *)iv, decData);
-    device_id = decData[3];
-#ifdef DEBUG_PRINT
-    for (int i = 0; i < 16; i++)
-      printf("%d:%d\n", i, decData[i]);
-#endif
-    set_device_buffer(device_id, decData);
-    out_socket = get_device_buffer(device_id, decData, MSG_TYPE_B);
+    uint64_t start = stats_now();
+    int dec_len = aes_ctx_decrypt(aes, in_buffer + 1 + AES_IV_LENGTH_BYTE,
+                                  MSG_SIZE + MSG_SIZE, iv, decData);
+    stats_record_since(&self->stats.decrypt, start);
+    if (dec_len != MSG_SIZE)
+      break;
+    out_socket = relay_msg_C2(decData, iv);
 
-    memset(out_buffer, 0, sizeof(*out_buffer));
+    memset(out_buffer, 0, sizeof(uint8_t) * AES_MSG_SIZE);
     memcpy(out_buffer, iv, AES_IV_LENGTH_BYTE);
-    encryptAES(decData, MSG_SIZE, (uint8_t *)key, (uint8_t *)iv,
-               out_buffer + AES_IV_LENGTH_BYTE);
+    start = stats_now();
+    int enc_len = aes_ctx_encrypt(aes, decData, MSG_SIZE, iv,
+                                  out_buffer + AES_IV_LENGTH_BYTE);
+    stats_record_since(&self->stats.encrypt, start);
+    if (enc_len < 0)
+      out_socket = -1;
+    *out_len = AES_IV_LENGTH_BYTE + enc_len;
     break;
 
+  case MSG_TYPE_C2R:
+    out_socket = forward_msg_C2R(in_buffer, out_buffer, out_len);
+    break;
+
+  case MSG_TYPE_C3:
+    send_history(in_socket, in_buffer);
+    break;
+
+  case MSG_TYPE_C4: {
+    struct connection *conn = find_connection(in_socket);
+    if (!conn || *((uint16_t *)(in_buffer + 1)) != CLIENT_PASSCODE)
+      break;
+    if (!in_buffer[C4_ACTION_IDX]) {
+      unsubscribe(conn);
+      break;
+    }
+    subscribe(conn);
+    // Baseline for the D4 deltas that follow
+    get_device_list(out_buffer);
+    *out_len = MSG_SIZE;
+    out_socket = in_socket;
+    break;
+  }
+
   default:
-    perror("Unknown message type");
+    LOG_WARN("Unknown message type %ld\n", msg_type);
   }
 
   return out_socket;
 }
 
-int main() {
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-  init_device_list(all_devices);
+void handle_payload(struct connection *conn,
+                    const uint8_t in_buffer[AES_MSG_SIZE], size_t in_len) {
+  uint8_t out_buffer[AES_MSG_SIZE] = {0};
+  size_t out_len = 0;
+  int type = in_buffer[MSG_TYPE_IDX];
+  if (type >= STATS_MSG_TYPES - 1)
+    type = STATS_MSG_TYPES - 1;
+  uint64_t start = stats_now();
+  int send_socket =
+      handle_client_message(conn->fd, in_buffer, in_len, out_buffer, &out_len);
+  stats_record_since(&self->stats.handle[type], start);
+  stats_add(&self->stats.messages[type], 1);
+  if (send_socket > -1)
+    send_message(send_socket, out_buffer, out_len);
+}
 
-  int server_fd, new_socket;
-  int max_clients = MAX_CLIENTS;
-  struct sockaddr_in address;
-  int addrlen = sizeof(address);
-  uint8_t in_buffer[AES_MSG_SIZE] = {0};
+// Peeks at the first byte of a new connection. Returns -1 if it was closed
+int detect_framing(struct connection *conn) {
+  uint8_t first;
+  int n = recv(conn->fd, &first, 1, MSG_PEEK);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (n <= 0) {
+    close_connection(conn, n == 0 ? DISCONNECT_PEER : DISCONNECT_READ_ERROR);
+    return -1;
+  }
+
+  if (first != FRAME_MAGIC) {
+    conn->framing = FRAMING_LEGACY;
+    return 0;
+  }
+  conn->rx = malloc(sizeof(*conn->rx));
+  if (!conn->rx) {
+    close_connection(conn, DISCONNECT_ERROR);
+    return -1;
+  }
+  frame_ring_init(conn->rx);
+  conn->framing = FRAMING_FRAMED;
+  return 0;
+}
+
+// Legacy peers: every read is taken as one message
+void read_legacy(struct connection *conn) {
+  uint8_t in_buffer[AES_MSG_SIZE];
+
+  // Edge-triggered: keep reading until the socket is drained
+  while (1) {
+    memset(in_buffer, 0, sizeof(in_buffer));
+    uint64_t start = stats_now();
+    int valread = read(conn->fd, in_buffer, AES_MSG_SIZE);
+    stats_record_since(&self->stats.socket_read, start);
+    if (valread < 0 && errno == EINTR)
+      continue;
+    if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    // Connection lost. Close socket
+    if (valread <= 0) {
+      close_connection(conn,
+                       valread == 0 ? DISCONNECT_PEER : DISCONNECT_READ_ERROR);
+      return;
+    }
+    stats_add(&self->stats.bytes_in, valread);
+
+    LOG_DEBUG("Received %ld bytes from client %ld\n", valread, conn->fd);
+    handle_payload(conn, in_buffer, valread);
+    if (conn->closing)
+      return;
+  }
+}
+
+/* Framed peers: drain the socket into the reassembly ring and handle every
+   complete frame, partial ones stay buffered for the next wakeup */
+void read_framed(struct connection *conn) {
+  uint8_t in_buffer[AES_MSG_SIZE];
+
+  while (1) {
+    uint64_t start = stats_now();
+    ssize_t valread = frame_ring_fill(conn->rx, conn->fd);
+    stats_record_since(&self->stats.socket_read, start);
+    if (valread < 0 && errno == EINTR)
+      continue;
+    if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (valread <= 0) {
+      close_connection(conn,
+                       valread == 0 ? DISCONNECT_PEER : DISCONNECT_READ_ERROR);
+      return;
+    }
+    stats_add(&self->stats.bytes_in, valread);
+
+    LOG_DEBUG("Received %ld bytes from client %ld\n", valread, conn->fd);
+    int len;
+    while ((len = frame_ring_next(conn->rx, in_buffer, sizeof(in_buffer))) >
+           0) {
+      memset(in_buffer + len, 0, sizeof(in_buffer) - len);
+      handle_payload(conn, in_buffer, len);
+      if (conn->closing)
+        return;
+    }
+    if (len < 0) {
+      LOG_WARN("Corrupt frame from client %ld\n", conn->fd);
+      close_connection(conn, DISCONNECT_CORRUPT_FRAME);
+      return;
+    }
+  }
+}
+
+void on_client_event(struct event_loop *loop, int fd, uint32_t events,
+                     void *data) {
+  struct connection *conn = data;
+  if ((events & EVENT_WRITE) && flush_connection(conn) < 0)
+    return;
+  if (!(events & EVENT_READ) || conn->closing)
+    return;
+  if (conn->framing == FRAMING_UNKNOWN && detect_framing(conn) < 0)
+    return;
+
+  if (conn->framing == FRAMING_LEGACY)
+    read_legacy(conn);
+  else if (conn->framing == FRAMING_FRAMED)
+    read_framed(conn);
+}
+
+void on_accept(struct event_loop *loop, int server_fd, uint32_t events,
+               void *data) {
+  // Drain the accept backlog; edge-triggered epoll reports it only once
+  while (1) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    int new_socket = accept4(server_fd, (struct sockaddr *)&address, &addrlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Accept failed");
+      return;
+    }
+
+    printf("New connection, socket fd is %d\n", new_socket);
+
+    struct connection *conn = open_connection(new_socket, &address);
+    if (!conn) {
+      printf("Out of memory for connection %d\n", new_socket);
+      close(new_socket);
+      continue;
+    }
+    stats_add(&self->stats.accepted, 1);
+    if (event_loop_add(loop, new_socket, EVENT_READ, on_client_event, conn) <
+        0) {
+      close_connection(conn, DISCONNECT_ERROR);
+    }
+  }
+}
+
+void on_timer_tick(struct event_loop *loop, int fd, uint32_t events,
+                   void *data) {
+  timer_wheel_process(data);
+}
+
+void handle_mail(struct mail *mail) {
   uint8_t out_buffer[AES_MSG_SIZE] = {0};
 
+  switch (mail->type) {
+  case MAIL_C1:
+    get_device_buffer(mail->buffer[1], out_buffer, MSG_TYPE_D1);
+    mail->type = MAIL_DELIVER;
+    memcpy(mail->buffer, out_buffer, MSG_SIZE);
+    mail->len = MSG_SIZE;
+    post_mail(mail->reply_worker, mail);
+    return; // Ownership moved on with the reply
+
+  case MAIL_C2:
+    set_device_buffer(mail->buffer[3], mail->buffer);
+    int out_socket = get_device_buffer(mail->buffer[3], mail->buffer,
+                                       MSG_TYPE_B);
+    if (out_socket > -1) {
+      unsigned char key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+      memcpy(out_buffer, mail->iv, AES_IV_LENGTH_BYTE);
+      int len = aes_ctx_encrypt(aes_thread_ctx(key), mail->buffer, MSG_SIZE,
+                                mail->iv, out_buffer + AES_IV_LENGTH_BYTE);
+      if (len > 0)
+        send_message(out_socket, out_buffer, AES_IV_LENGTH_BYTE + len);
+    }
+    break;
+
+  case MAIL_C2R: {
+    struct device_s *device = registry_find(&self->registry, mail->device_id);
+    if (device && device->socket > -1 &&
+        record_msg_C2R(mail->device_id, mail->buffer) == 0) {
+      memcpy(out_buffer, mail->buffer, mail->len);
+      send_message(device->socket, out_buffer, mail->len);
+    }
+    break;
+  }
+
+  case MAIL_PUSH:
+    push_to_subscribers(mail->framed, mail->legacy);
+    out_buf_unref(mail->framed);
+    out_buf_unref(mail->legacy);
+    break;
+
+  case MAIL_DELIVER: {
+    struct connection *conn = find_connection(mail->reply_fd);
+    if (conn && conn->id == mail->reply_conn_id) {
+      memcpy(out_buffer, mail->buffer, mail->len);
+      send_message(conn->fd, out_buffer, mail->len);
+    }
+    break;
+  }
+  }
+  free(mail);
+}
+
+void on_mailbox(struct event_loop *loop, int fd, uint32_t events,
+                void *data) {
+  struct mailbox *mailbox = data;
+  mailbox_begin_drain(mailbox);
+  struct mail_node *node;
+  while ((node = mailbox_take(mailbox))) {
+    stats_add(&self->stats.mail_handled, 1);
+    handle_mail((struct mail *)node);
+  }
+}
+
+void sync_snapshot(struct wheel_timer *timer, void *data) {
+  snapshot_sync(&snapshot);
+  timer_wheel_schedule(&self->wheel, timer, SNAPSHOT_SYNC_MS);
+}
+
+/* Loads the snapshot into every worker's shard, so C0 and C1 answer with
+   the last known state right away. Devices that were connected are listed
+   as online, held by the first worker, until they reconnect or their
+   inactivity timeout runs out. Called before the workers start. */
+void restore_snapshot(void) {
+  int online = 0;
+  uint32_t count = snapshot.header->count;
+  for (uint32_t i = 0; i < count; i++) {
+    struct snapshot_record *record = &snapshot.records[i];
+    for (int w = 0; w < worker_count; w++) {
+      struct device_s *device = registry_add(&workers[w].registry, record->id);
+      if (!device)
+        continue;
+      device->snapshot = record;
+      parse_msg_A(device, record->msg_A_buf);
+      struct device_msgs *msgs =
+          registry_msgs(&workers[w].registry, device->index);
+      memcpy(msgs->msg_A_buf, record->msg_A_buf, MSG_SIZE);
+      memcpy(msgs->msg_C2_buf, record->msg_C2_buf, MSG_SIZE);
+      device->rem_cut_off_time = record->rem_cut_off_time;
+      device->set_cut_off_time = record->set_cut_off_time;
+      device->last_seen = record->last_seen;
+      if (w > 0 || !record->online)
+        continue;
+
+      device->restored = true;
+      registry_set_online(&workers[0].registry, device, 1);
+      wheel_timer_init(&device->device_connection_timer, disconnect_client,
+                       device);
+      timer_wheel_schedule(&workers[0].wheel, &device->device_connection_timer,
+                           inactive_sec * 1000);
+      if (worker_count > 1)
+        directory_set_online(&directory, device->id, 0);
+      online++;
+    }
+  }
+  printf("Restored %u device(s) from snapshot, %d online\n", count, online);
+}
+
+uint64_t sum_counter(size_t offset) {
+  uint64_t sum = 0;
+  for (int w = 0; w < worker_count; w++)
+    sum += stats_read((stats_counter *)((char *)&workers[w].stats + offset));
+  return sum;
+}
+
+#define SUM_STAT(field) sum_counter(offsetof(struct worker_stats, field))
+
+void write_histogram(FILE *out, const char *name, size_t offset) {
+  struct stats_histogram merged = {0};
+  for (int w = 0; w < worker_count; w++)
+    stats_merge(&merged,
+                (struct stats_histogram *)((char *)&workers[w].stats + offset));
+  uint64_t count = stats_read(&merged.count);
+  if (count == 0)
+    return;
+  fprintf(out,
+          "latency_ns.%s count=%lu mean=%lu p50=%lu p90=%lu p99=%lu "
+          "p999=%lu max=%lu\n",
+          name, count, stats_read(&merged.sum) / count,
+          stats_quantile(&merged, 0.5), stats_quantile(&merged, 0.9),
+          stats_quantile(&merged, 0.99), stats_quantile(&merged, 0.999),
+          stats_read(&merged.max));
+}
+
+#define WRITE_HISTOGRAM(out, name, field)                                      \
+  write_histogram(out, name, offsetof(struct worker_stats, field))
+
+/* One "name value" line per counter summed over all workers, and one line
+   per non-empty histogram. Reads other workers' stats while they run, so
+   related numbers can be off by the few updates made meanwhile. */
+void write_stats(FILE *out) {
+  uint64_t accepted = SUM_STAT(accepted);
+  uint64_t closed = 0;
+  for (int r = 0; r < DISCONNECT_REASONS; r++)
+    closed += SUM_STAT(disconnects[r]);
+  uint64_t max = 0;
+  for (int w = 0; w < worker_count; w++)
+    if (stats_read(&workers[w].stats.queue_max) > max)
+      max = stats_read(&workers[w].stats.queue_max);
+
+  fprintf(out, "uptime_ms %lu\n", (stats_now() - start_time) / 1000000);
+  fprintf(out, "workers %d\n", worker_count);
+  fprintf(out, "connections %ld\n", (int64_t)(accepted - closed));
+  fprintf(out, "accepted %lu\n", accepted);
+  for (int r = 0; r < DISCONNECT_REASONS; r++)
+    fprintf(out, "disconnects.%s %lu\n", disconnect_names[r],
+            SUM_STAT(disconnects[r]));
+  for (int t = 0; t < STATS_MSG_TYPES; t++)
+    fprintf(out, "messages.%s %lu\n", message_names[t],
+            SUM_STAT(messages[t]));
+  fprintf(out, "bytes_in %lu\n", SUM_STAT(bytes_in));
+  fprintf(out, "bytes_out %lu\n", SUM_STAT(bytes_out));
+  fprintf(out, "outq.bytes %ld\n", (int64_t)SUM_STAT(queued));
+  fprintf(out, "outq.max_bytes %lu\n", max);
+  fprintf(out, "outq.dropped %lu\n", SUM_STAT(dropped));
+  fprintf(out, "mailbox.pending %ld\n",
+          (int64_t)(SUM_STAT(mail_sent) - SUM_STAT(mail_handled)));
+
+  char name[32];
+  for (int t = 0; t < STATS_MSG_TYPES; t++) {
+    snprintf(name, sizeof(name), "handle.%s", message_names[t]);
+    WRITE_HISTOGRAM(out, name, handle[t]);
+  }
+  WRITE_HISTOGRAM(out, "decrypt", decrypt);
+  WRITE_HISTOGRAM(out, "encrypt", encrypt);
+  WRITE_HISTOGRAM(out, "decrypt_batch", decrypt_batch);
+  WRITE_HISTOGRAM(out, "encrypt_batch", encrypt_batch);
+  WRITE_HISTOGRAM(out, "route_verify", route_verify);
+  WRITE_HISTOGRAM(out, "socket_read", socket_read);
+  WRITE_HISTOGRAM(out, "socket_write", socket_write);
+}
+
+// Answers every connection to the stats socket with a report and closes it
+void on_stats_accept(struct event_loop *loop, int fd, uint32_t events,
+                     void *data) {
+  while (1) {
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    char *report = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&report, &len);
+    if (out) {
+      write_stats(out);
+      fclose(out);
+      // A report fits in the socket buffer, a reader that stalls loses it
+      if (send(client, report, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+        perror("Could not send stats");
+      free(report);
+    }
+    close(client);
+  }
+}
+
+int open_stats_socket(const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Stats socket path too long\n");
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("Stats socket creation failed");
+    return -1;
+  }
+  // Left over from a previous run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, 16) < 0) {
+    perror("Stats socket bind failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void usage(const char *prog) {
+  printf("Usage: %s [-b epoll|select] [-B] [-t threads] [-q bytes] "
+         "[-o drop|disconnect] [-s snapshot] [-S stats socket] "
+         "[-i inactive seconds]\n",
+         prog);
+}
+
+int open_listener(void) {
+  int server_fd;
+  struct sockaddr_in address;
+
   // Create a socket
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     perror("Socket creation failed");
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
-  // Set socket options to allow reusing the address
-  int opt = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                 sizeof(opt))) {
+  /* Set socket options to allow reusing the address. SO_REUSEPORT lets
+     every worker bind its own socket; the kernel spreads connections */
+  int reuse = 1;
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) ||
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))) {
     perror("Setsockopt failed");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
   }
 
   address.sin_family = AF_INET;
@@ -251,91 +1459,167 @@ int main() {
   // Bind the socket to the specified port
   if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
     perror("Bind failed");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
   }
 
   // Listen for incoming connections
-  if (listen(server_fd, max_clients) < 0) {
+  if (listen(server_fd, SOMAXCONN) < 0) {
     perror("Listen failed");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
+  }
+
+  if (set_nonblocking(server_fd) < 0) {
+    perror("Could not make listening socket non-blocking");
+    close(server_fd);
+    return -1;
   }
+  return server_fd;
+}
 
-  printf("Server listening on port %d...\n", SERVER_PORT);
+int worker_init(struct worker *worker, int index) {
+  worker->index = index;
+  worker->listen_fd = open_listener();
+  if (worker->listen_fd < 0)
+    return -1;
 
-  fd_set read_fds;
-  int max_sd, activity;
-  for (int i = 0; i < max_clients; i++) {
-    client_sockets[i] = -1;
+  if (registry_init(&worker->registry, REGISTRY_INITIAL_CAPACITY) < 0) {
+    printf("Could not allocate device registry\n");
+    return -1;
   }
 
+  worker->loop = event_loop_create(backend);
+  if (!worker->loop || timer_wheel_init(&worker->wheel, SERVER_TICK_MS) < 0 ||
+      mailbox_init(&worker->mailbox) < 0 ||
+      event_loop_add(worker->loop, timer_wheel_fd(&worker->wheel), EVENT_READ,
+                     on_timer_tick, &worker->wheel) ||
+      event_loop_add(worker->loop, worker->mailbox.event_fd, EVENT_READ,
+                     on_mailbox, &worker->mailbox) ||
+      event_loop_add(worker->loop, worker->listen_fd, EVENT_READ, on_accept,
+                     NULL)) {
+    printf("Could not create %s event loop\n", event_backend_name(backend));
+    return -1;
+  }
+  return 0;
+}
+
+void *worker_run(void *arg) {
+  self = arg;
+
   // Main loop
   while (1) {
-    FD_ZERO(&read_fds);
-    FD_SET(server_fd, &read_fds);
-    max_sd = server_fd;
+    if (event_loop_run_once(self->loop, -1) < 0)
+      perror("Event loop error");
+    flush_c2_batch();
+    flush_pending();
+  }
+  return NULL;
+}
 
-    for (int i = 0; i < max_clients; i++) {
-      if (client_sockets[i] > -1) {
-        FD_SET(client_sockets[i], &read_fds);
+// microbench.c includes this file to time the handlers without a server
+#ifndef SERVER_NO_MAIN
+int main(int argc, char *argv[]) {
+  int opt;
+  const char *snapshot_path = NULL;
+  const char *stats_path = NULL;
+  while ((opt = getopt(argc, argv, "b:Bt:q:o:s:S:i:h")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (event_backend_parse(optarg, &backend) < 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'B':
+      batch_crypto = true;
+      break;
+    case 't':
+      worker_count = atoi(optarg);
+      if (worker_count < 1 || worker_count > MAX_WORKERS) {
+        printf("Worker threads must be between 1 and %d\n", MAX_WORKERS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'q':
+      outq_limit = strtoul(optarg, NULL, 10);
+      if (outq_limit < AES_MSG_SIZE + FRAME_HEADER_SIZE) {
+        printf("Output queue limit must be at least %d bytes\n",
+               AES_MSG_SIZE + FRAME_HEADER_SIZE);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'o':
+      if (strcmp(optarg, "drop") == 0)
+        overflow_policy = OVERFLOW_DROP;
+      else if (strcmp(optarg, "disconnect") == 0)
+        overflow_policy = OVERFLOW_DISCONNECT;
+      else {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
       }
-      if (client_sockets[i] > max_sd) {
-        max_sd = client_sockets[i];
+      break;
+    case 's':
+      snapshot_path = optarg;
+      break;
+    case 'S':
+      stats_path = optarg;
+      break;
+    case 'i':
+      inactive_sec = atoi(optarg);
+      if (inactive_sec < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
       }
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
     }
+  }
 
-    // Check for event on sockets
-    activity = select(max_sd + 1, &read_fds, NULL, NULL, NULL);
-    if ((activity < 0) && (errno != EINTR)) {
-      printf("Select error\n");
-    }
+  workers = calloc(worker_count, sizeof(*workers));
+  if (!workers || directory_init(&directory, REGISTRY_INITIAL_CAPACITY) < 0) {
+    printf("Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  // Bind every listener before any worker runs, so none is missed
+  for (int i = 0; i < worker_count; i++) {
+    if (worker_init(&workers[i], i) < 0)
+      exit(EXIT_FAILURE);
+  }
 
-    // Check for incoming connection request
-    if (FD_ISSET(server_fd, &read_fds)) {
-      if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
-                               (socklen_t *)&addrlen)) < 0) {
-        perror("Accept failed");
-      }
+  if (snapshot_path) {
+    if (snapshot_open(&snapshot, snapshot_path) < 0)
+      exit(EXIT_FAILURE);
+    restore_snapshot();
+    wheel_timer_init(&snapshot_timer, sync_snapshot, NULL);
+    timer_wheel_schedule(&workers[0].wheel, &snapshot_timer, SNAPSHOT_SYNC_MS);
+  }
 
-      printf("New connection, socket fd is %d\n", new_socket);
+  start_time = stats_now();
+  if (stats_path) {
+    stats_fd = open_stats_socket(stats_path);
+    if (stats_fd < 0 || event_loop_add(workers[0].loop, stats_fd, EVENT_READ,
+                                       on_stats_accept, NULL) < 0)
+      exit(EXIT_FAILURE);
+  }
 
-      for (int i = 0; i < max_clients; i++) {
-        if (client_sockets[i] == -1) {
-          client_sockets[i] = new_socket;
-          printf("Adding to list of sockets as %d\n", i);
-          break;
-        }
-      }
-    }
+  if (log_start() < 0)
+    exit(EXIT_FAILURE);
 
-    // Check for incoming packets
-    for (int i = 0; i < max_clients; i++) {
-      if (FD_ISSET(client_sockets[i], &read_fds)) {
-        int valread;
-        // Connection lost. Close socket
-        if ((valread = read(client_sockets[i], in_buffer, AES_MSG_SIZE)) <= 0) {
-          getpeername(client_sockets[i], (struct sockaddr *)&address,
-                      (socklen_t *)&addrlen);
-          printf("Host disconnected, ip %s, port %d\n",
-                 inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-          close(client_sockets[i]);
-          client_sockets[i] = -1;
-        } else { // Reveive incoming packets
-          printf("Received %d bytes from client %d\n", valread, i);
-          int send_socket =
-              handle_client_message(client_sockets[i], in_buffer, out_buffer);
-          if (send_socket > -1) {
-            int sent_bytes;
-            sent_bytes = send(send_socket, out_buffer, sizeof(out_buffer), 0);
-            if (sent_bytes < 0)
-              printf("Could not send data to socket %d\n", send_socket);
-            else {
-              printf("Send success %d bytes\n", sent_bytes);
-            }
-          }
-        }
-      }
+  printf("Server listening on port %d using %s with %d worker(s)...\n",
+         SERVER_PORT, event_backend_name(backend), worker_count);
+
+  // Worker 0 runs on the main thread
+  for (int i = 1; i < worker_count; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+      perror("Could not start worker");
+      exit(EXIT_FAILURE);
     }
   }
+  worker_run(&workers[0]);
 
   return 0;
 }
+#endif
@@ -2,10 +2,13 @@
 #define SERVER_BASE_H
 
 #include "common.h"
+#include "event_loop/timer_wheel.h"
+#include "history.h"
+#include "snapshot.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
-#define MAX_DEVICES 2
-#define MAX_CLIENTS 3
 #define CLIENT_PASSCODE 39403
 
 enum message_types {
@@ -15,13 +18,66 @@ enum message_types {
   MSG_TYPE_C1,
   MSG_TYPE_C2,
   MSG_TYPE_D0,
-  MSG_TYPE_D1
+  MSG_TYPE_D1,
+  MSG_TYPE_C2R,
+  MSG_TYPE_C3,
+  MSG_TYPE_D3,
+  MSG_TYPE_C4,
+  MSG_TYPE_D4,
+  MSG_TYPE_A1,
+  MSG_TYPE_A2
 };
 
+/* C2R: a C2 with a cleartext routing header. The client encrypts the Msg B
+   plaintext for the device itself and tags header, IV and ciphertext with
+   aes_ctx_route_tag(). The server checks the tag and forwards IV and
+   ciphertext to the device byte for byte; it only decrypts them to record
+   the command, never encrypts.
+   [type][device id][IV, 16 bytes][ciphertext, 32 bytes][tag, 8 bytes] */
+#define C2R_DEVICE_IDX 1
+#define C2R_IV_IDX 2
+#define C2R_TAG_IDX 50
+#define C2R_SIZE 58
+
+/* C3: telemetry history of one device over a time range, little endian,
+   times in seconds since the epoch. A non-zero resolution merges the
+   samples of each resolution seconds wide bucket into one.
+   [type][device id][from, 4 bytes][to, 4 bytes][resolution, 2 bytes]
+   Answered with one or more D3, more is 1 on all but the last:
+   [type][device id][sample count][more][samples]
+   Each sample is [time, 4 bytes][ADC 0..3, 2 bytes each][rssi][gpio]. */
+#define C3_DEVICE_IDX 1
+#define C3_FROM_IDX 2
+#define C3_TO_IDX 6
+#define C3_RESOLUTION_IDX 10
+#define D3_HEADER_SIZE 4
+#define D3_SAMPLE_SIZE 14
+#define D3_MAX_SAMPLES 8 // Fits a legacy AES_MSG_SIZE reply
+#define C3_MAX_SAMPLES 256 // Per query, ask again from the last time for more
+
+/* C4: subscribe to or unsubscribe from updates of all devices.
+   [type][passcode, 2 bytes][1 subscribe, 0 unsubscribe]
+   A subscribe is answered with a D0 of the current list. From then on the
+   server pushes a D1 for every Msg A it accepts and a D4 whenever a device
+   comes online or goes offline: [type][device id][1 online, 0 offline] */
+#define C4_ACTION_IDX 3
+#define D4_SIZE 3
+
+/* Per-device state. Lookups and fleet scans run on the registry's dense
+   id and online arrays; this struct is only touched once a device has been
+   found. Fields used on every Msg A come first. The last Msg A and Msg B
+   are in struct device_msgs. */
 struct device_s {
-  char id;
-  int passcode;
+  uint32_t id;
+  uint32_t index; // Position in the registry's dense arrays
   int socket;
+  struct wheel_timer device_connection_timer;
+  time_t last_seen;
+  struct telemetry_history *history;
+  struct snapshot_record *snapshot; // NULL without a snapshot file
+  bool restored; // Listed as online from the snapshot until it reconnects
+  char gpio_states;
+  int passcode;
   int rem_cut_off_time;
   int set_cut_off_time;
   int last_rssi;
@@ -29,10 +85,13 @@ struct device_s {
   int adc_1;
   int adc_2;
   int adc_3;
-  char gpio_states;
+};
+
+/* Last Msg A and Msg B of a device, only read for C1, D1 and the snapshot.
+   Kept by the registry apart from struct device_s, at the same index. */
+struct device_msgs {
   char msg_A_buf[MSG_SIZE];
   char msg_C2_buf[MSG_SIZE];
-  timer_t device_connection_timer;
 };
 
 #endif
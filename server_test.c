@@ -0,0 +1,125 @@
+/*
+
+Feeds framed messages through the server's read path. The server is
+compiled in without its main, like in microbench, and runs on a single
+worker with no threads.
+
+*/
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+#define TEST_DEVICE_ID 7
+
+struct worker test_worker;
+
+// A framed connection whose peer end is returned in peer
+struct connection *test_connection(int *peer) {
+  int fds[2];
+  struct sockaddr_in address = {.sin_family = AF_INET};
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+      set_nonblocking(fds[0]) < 0) {
+    perror("socketpair failed");
+    exit(EXIT_FAILURE);
+  }
+  struct connection *conn = open_connection(fds[0], &address);
+  if (!conn)
+    exit(EXIT_FAILURE);
+  *peer = fds[1];
+  return conn;
+}
+
+// Sends len bytes of payload in one frame and lets the server read it
+void send_frame(struct connection *conn, int peer, const uint8_t *payload,
+                size_t len) {
+  uint8_t frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+  frame[0] = FRAME_MAGIC;
+  frame[1] = len & 0xFF;
+  frame[2] = len >> 8;
+  memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+  if (write(peer, frame, FRAME_HEADER_SIZE + len) < 0) {
+    perror("write failed");
+    exit(EXIT_FAILURE);
+  }
+  if (conn->framing == FRAMING_UNKNOWN)
+    detect_framing(conn);
+  read_framed(conn);
+}
+
+int stored_samples(uint8_t device_id) {
+  struct telemetry_sample samples[C3_MAX_SAMPLES];
+  struct telemetry_history *history =
+      directory_find_history(&directory, device_id);
+  if (!history)
+    return 0;
+  return history_query(history, 0, UINT32_MAX, 0, samples, C3_MAX_SAMPLES);
+}
+
+int main(void) {
+  self = workers = &test_worker;
+  worker_count = 1;
+  outq_limit = SIZE_MAX;
+  if (registry_init(&self->registry, REGISTRY_INITIAL_CAPACITY) < 0 ||
+      directory_init(&directory, REGISTRY_INITIAL_CAPACITY) < 0 ||
+      !(self->loop = event_loop_create(EVENT_BACKEND_EPOLL)) ||
+      timer_wheel_init(&self->wheel, SERVER_TICK_MS) < 0) {
+    printf("Could not set up the worker\n");
+    return -1;
+  }
+
+  struct msg_A2_fields packed = {PASSCODE_LO | PASSCODE_HI << 8,
+                                 TEST_DEVICE_ID, -40, 5, 0x11, 10, 0,
+                                 MSG_A2_MAX_SAMPLES};
+  for (int i = 0; i < MSG_A2_MAX_SAMPLES; i++)
+    for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+      packed.adc[i][ch] = (i + ch) % 2 ? 1023 : 0;
+  uint8_t msg_A2[AES_MSG_SIZE] = {0};
+  int len = msg_A2_pack(msg_A2, &packed);
+
+  int peer;
+  struct connection *conn = test_connection(&peer);
+  int fd = conn->fd; // conn is freed if the server closes it
+
+  // A frame cut short must not be filled up with zero deltas
+  send_frame(conn, peer, msg_A2, len - 1);
+  if (!find_connection(fd) || stored_samples(TEST_DEVICE_ID) != 0 ||
+      registry_find(&self->registry, TEST_DEVICE_ID)) {
+    printf("Truncated A2 was stored\n");
+    return -1;
+  }
+
+  send_frame(conn, peer, msg_A2, len);
+  if (stored_samples(TEST_DEVICE_ID) != MSG_A2_MAX_SAMPLES) {
+    printf("Complete A2 was not stored\n");
+    return -1;
+  }
+
+  // A C2R is recorded for C1 and the snapshot like a C2
+  uint8_t key[AES_KEY_LENGTH_BYTE] = AES_KEY;
+  aes_ctx_t *aes = aes_thread_ctx(key);
+  uint8_t msg_B[MSG_SIZE] = {MSG_TYPE_B, PASSCODE_LO, PASSCODE_HI,
+                             TEST_DEVICE_ID, 1, 30, 1};
+  uint8_t msg_C2R[C2R_SIZE] = {MSG_TYPE_C2R, TEST_DEVICE_ID};
+  RAND_bytes(msg_C2R + C2R_IV_IDX, AES_IV_LENGTH_BYTE);
+  aes_ctx_encrypt(aes, msg_B, MSG_SIZE, msg_C2R + C2R_IV_IDX,
+                  msg_C2R + C2R_IV_IDX + AES_IV_LENGTH_BYTE);
+  aes_ctx_route_tag(aes, msg_C2R, C2R_TAG_IDX, msg_C2R + C2R_TAG_IDX);
+  send_frame(conn, peer, msg_C2R, sizeof(msg_C2R));
+  struct device_s *device = registry_find(&self->registry, TEST_DEVICE_ID);
+  if (!device || memcmp(device_msgs(device)->msg_C2_buf, msg_B, MSG_SIZE) != 0) {
+    printf("C2R was not recorded\n");
+    return -1;
+  }
+
+  // The largest payload the framing layer accepts fits the receive buffer
+  uint8_t msg_C0[FRAME_MAX_PAYLOAD] = {MSG_TYPE_C0, CLIENT_PASSCODE & 0xFF,
+                                       CLIENT_PASSCODE >> 8};
+  send_frame(conn, peer, msg_C0, sizeof(msg_C0));
+  if (!find_connection(fd)) {
+    printf("Frame of FRAME_MAX_PAYLOAD bytes closed the connection\n");
+    return -1;
+  }
+
+  printf("Pass\n");
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+static uint32_t hash_id(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id;
+}
+
+static uint32_t *probe(struct device_snapshot *snap, uint32_t id) {
+  size_t mask = snap->index_capacity - 1;
+  size_t i = hash_id(id) & mask;
+  while (snap->index[i] && snap->records[snap->index[i] - 1].id != id)
+    i = (i + 1) & mask;
+  return &snap->index[i];
+}
+
+static int header_valid(const struct snapshot_header *header) {
+  return header->magic == SNAPSHOT_MAGIC &&
+         header->version == SNAPSHOT_VERSION &&
+         header->record_size == sizeof(struct snapshot_record) &&
+         header->capacity == SNAPSHOT_CAPACITY &&
+         header->count <= SNAPSHOT_CAPACITY;
+}
+
+int snapshot_open(struct device_snapshot *snap, const char *path) {
+  memset(snap, 0, sizeof(*snap));
+  snap->map_size = sizeof(struct snapshot_header) +
+                   sizeof(struct snapshot_record) * SNAPSHOT_CAPACITY;
+
+  snap->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (snap->fd < 0) {
+    perror("Could not open snapshot");
+    return -1;
+  }
+  // A file with another layout is emptied; sparse, so only records in use
+  // take disk space
+  struct snapshot_header header = {0};
+  int valid = pread(snap->fd, &header, sizeof(header), 0) == sizeof(header) &&
+              header_valid(&header);
+  if (!valid && header.magic)
+    printf("Snapshot %s has another layout, starting over\n", path);
+  if ((!valid && ftruncate(snap->fd, 0) < 0) ||
+      ftruncate(snap->fd, snap->map_size) < 0) {
+    perror("Could not size snapshot");
+    close(snap->fd);
+    return -1;
+  }
+  void *map = mmap(NULL, snap->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   snap->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Could not map snapshot");
+    close(snap->fd);
+    return -1;
+  }
+  snap->header = map;
+  snap->records = (struct snapshot_record *)(snap->header + 1);
+
+  if (!valid) {
+    snap->header->magic = SNAPSHOT_MAGIC;
+    snap->header->version = SNAPSHOT_VERSION;
+    snap->header->record_size = sizeof(struct snapshot_record);
+    snap->header->capacity = SNAPSHOT_CAPACITY;
+  }
+
+  snap->index_capacity = SNAPSHOT_CAPACITY * 2;
+  snap->index = calloc(snap->index_capacity, sizeof(*snap->index));
+  if (!snap->index || pthread_mutex_init(&snap->lock, NULL)) {
+    snapshot_close(snap);
+    return -1;
+  }
+  for (uint32_t i = 0; i < snap->header->count; i++)
+    *probe(snap, snap->records[i].id) = i + 1;
+  return 0;
+}
+
+void snapshot_close(struct device_snapshot *snap) {
+  if (snap->header) {
+    msync(snap->header, snap->map_size, MS_SYNC);
+    munmap(snap->header, snap->map_size);
+  }
+  if (snap->fd > -1)
+    close(snap->fd);
+  free(snap->index);
+  memset(snap, 0, sizeof(*snap));
+  snap->fd = -1;
+}
+
+struct snapshot_record *snapshot_record(struct device_snapshot *snap,
+                                        uint32_t id) {
+  struct snapshot_record *record = NULL;
+  pthread_mutex_lock(&snap->lock);
+  uint32_t *slot = probe(snap, id);
+  if (*slot) {
+    record = &snap->records[*slot - 1];
+  } else if (snap->header->count < SNAPSHOT_CAPACITY) {
+    record = &snap->records[snap->header->count];
+    memset(record, 0, sizeof(*record));
+    record->id = id;
+    *slot = ++snap->header->count;
+  }
+  pthread_mutex_unlock(&snap->lock);
+  return record;
+}
+
+void snapshot_sync(struct device_snapshot *snap) {
+  if (snap->header)
+    msync(snap->header, snap->map_size, MS_ASYNC);
+}
@@ -0,0 +1,61 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define SNAPSHOT_MAGIC 0x50534452 // "RDSP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CAPACITY 65536 // Records, the file is sized for all of them
+
+/* On-disk layout, little endian, never reordered: bump SNAPSHOT_VERSION
+   when a field changes. A file with another magic, version or layout is
+   started over. */
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint32_t count; // Records in use, filled from index 0
+  uint32_t reserved;
+};
+
+struct snapshot_record {
+  uint32_t id;
+  uint8_t online; // Connected when last written
+  uint8_t reserved[3];
+  int32_t rem_cut_off_time;
+  int32_t set_cut_off_time;
+  int64_t last_seen; // Seconds since the epoch of the last Msg A
+  char msg_A_buf[MSG_SIZE];
+  char msg_C2_buf[MSG_SIZE];
+};
+
+/* Device state mapped from a file and updated in place. The mapping has a
+   fixed size, so record pointers stay valid for the process lifetime and
+   workers write the records of their devices without locking. Only
+   assigning a record to a new id takes the lock. */
+struct device_snapshot {
+  pthread_mutex_t lock;
+  int fd;
+  struct snapshot_header *header;
+  struct snapshot_record *records;
+  size_t map_size;
+  uint32_t *index; // id -> record index + 1, open addressing, 0 is empty
+  size_t index_capacity;
+};
+
+int snapshot_open(struct device_snapshot *snap, const char *path);
+
+void snapshot_close(struct device_snapshot *snap);
+
+// Record of the device, assigned on first use. NULL once the file is full
+struct snapshot_record *snapshot_record(struct device_snapshot *snap,
+                                        uint32_t id);
+
+// Schedules writeback of dirty pages without blocking
+void snapshot_sync(struct device_snapshot *snap);
+
+#endif
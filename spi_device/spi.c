@@ -1,3 +1,5 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,14 +32,14 @@ int spi_init()
   fd = open(SPI_DEVICE, O_RDWR);
   if(fd < 0) {
     printf("Could not open the SPI device...\r\n");
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   ret = ioctl(fd, SPI_IOC_RD_MODE, &scratch);
   if(ret != 0) {
     printf("Could not read SPI mode...\r\n");
     close(fd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
   printf("SPI mode is %x\n", scratch);
 
@@ -47,14 +49,14 @@ int spi_init()
   if(ret != 0) {
     printf("Could not write SPI mode...\r\n");
     close(fd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &scratch32);
   if(ret != 0) {
     printf("Could not read the SPI max speed...\r\n");
     close(fd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
   printf("SPI max speed is %d\n", scratch32);
 
@@ -64,8 +66,9 @@ int spi_init()
   if(ret != 0) {
     printf("Could not write the SPI max speed...\r\n");
     close(fd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
+  return 0;
 }
 
 uint16_t get_raw_voltage(int channel)
@@ -99,38 +102,153 @@ uint16_t get_raw_voltage(int channel)
   return doc;
 }
 
+/* Converts count channels with one SPI_IOC_MESSAGE(count). The chip starts
+   a conversion on the falling edge of CS, so CS is released between the
+   transfers with cs_change */
+static int transfer_channels(const uint8_t *channels, int count,
+                             uint16_t *values)
+{
+  uint8_t tx_buffer[SPI_MAX_TRANSFERS][LEN_DATA];
+  uint8_t rx_buffer[SPI_MAX_TRANSFERS][LEN_DATA];
+  struct spi_ioc_transfer trxs[SPI_MAX_TRANSFERS];
+  memset(trxs, 0, sizeof(*trxs) * count);
+  memset(rx_buffer, 0, sizeof(rx_buffer[0]) * count);
+
+  for (int i = 0; i < count; i++) {
+    tx_buffer[i][0] = 0x01; //start bit
+    tx_buffer[i][1] = 0x80 | ((channels[i] & 0x03) << 4);
+    tx_buffer[i][2] = 0x00;
+    trxs[i].tx_buf = (unsigned long)tx_buffer[i];
+    trxs[i].rx_buf = (unsigned long)rx_buffer[i];
+    trxs[i].len = LEN_DATA;
+    trxs[i].speed_hz = spi_speed;
+    trxs[i].cs_change = i < count - 1;
+  }
+
+  int ret = ioctl(fd, SPI_IOC_MESSAGE(count), trxs);
+  if(ret < 0) {
+    printf("SPI transfer returned %d... errorno %d\r\n", ret, errno);
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++)
+    values[i] = ((rx_buffer[i][1] & 0x3) << 8) | (rx_buffer[i][2] & 0xFF);
+  return 0;
+}
+
+int spi_read_all(uint16_t values[SPI_CHANNELS])
+{
+  uint8_t channels[SPI_CHANNELS];
+  for (int ch = 0; ch < SPI_CHANNELS; ch++)
+    channels[ch] = ch;
+  return transfer_channels(channels, SPI_CHANNELS, values);
+}
+
+int spi_read_samples(int samples, uint16_t *values)
+{
+  uint8_t channels[SPI_MAX_TRANSFERS];
+  for (int i = 0; i < SPI_MAX_TRANSFERS; i++)
+    channels[i] = i % SPI_CHANNELS;
+
+  // Whole rounds per ioctl, so every chunk starts at channel 0
+  int per_ioctl = SPI_MAX_TRANSFERS / SPI_CHANNELS * SPI_CHANNELS;
+  int total = samples * SPI_CHANNELS;
+  for (int done = 0; done < total; done += per_ioctl) {
+    int count = total - done < per_ioctl ? total - done : per_ioctl;
+    if (transfer_channels(channels, count, values + done) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 float get_avg_voltage(int channel, int num_read)
 {
-  uint8_t tx_buffer[LEN_DATA];
-  uint8_t rx_buffer[LEN_DATA];
-  trx.tx_buf = (unsigned long)tx_buffer;
-  trx.rx_buf = (unsigned long)rx_buffer;
-  trx.bits_per_word = 0;
-  trx.speed_hz = spi_speed;
-  trx.delay_usecs = 0;
-  trx.len = LEN_DATA;
-  float avgVolt = 0;
+  uint8_t channels[SPI_MAX_TRANSFERS];
+  uint16_t values[SPI_MAX_TRANSFERS];
+  memset(channels, channel, sizeof(channels));
   float sumVolt = 0;
 
-  tx_buffer[0] = 0x01; //start bit
-  tx_buffer[1] = 0x80 | ((channel & 0x03) << 4); // single or diff | channel number
-  tx_buffer[2] = 0x00;
+  // Up to SPI_MAX_TRANSFERS conversions per ioctl
+  for (int done = 0; done < num_read; done += SPI_MAX_TRANSFERS) {
+    int count = num_read - done < SPI_MAX_TRANSFERS ? num_read - done
+                                                    : SPI_MAX_TRANSFERS;
+    if (transfer_channels(channels, count, values) < 0)
+      memset(values, 0, sizeof(values[0]) * count);
+    for (int i = 0; i < count; i++)
+      sumVolt += ((float)values[i]) * VREF / 1024;
+  }
+  return sumVolt / num_read;
+}
 
-  for (int i = 0; i < num_read; i++) {
-    rx_buffer[0] = 0x00;
-    rx_buffer[1] = 0x00;
-    rx_buffer[2] = 0x00;
+struct spi_sample sampler_ring[SPI_SAMPLER_RING_SIZE];
+atomic_uint sampler_head; // Samples taken, free-running
+long sampler_period_us;
 
-    ret = ioctl(fd, SPI_IOC_MESSAGE(1), &trx);
-    if(ret < 0) {
-      printf("SPI transfer returned %d... errorno %d\r\n", ret, errno);
-    }
+static void *sampler_run(void *arg)
+{
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    unsigned head = atomic_load_explicit(&sampler_head, memory_order_relaxed);
+    struct spi_sample *sample =
+        &sampler_ring[head & (SPI_SAMPLER_RING_SIZE - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &sample->time);
+    if (spi_read_all(sample->adc) == 0)
+      atomic_store_explicit(&sampler_head, head + 1, memory_order_release);
+
+    next.tv_nsec += sampler_period_us * 1000;
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
 
-    int16_t doc = ((rx_buffer[1] & 0x3) << 8) | (rx_buffer[2] & 0xFF);
-    float volt = ((float)doc) * VREF / 1024;
+int spi_sampler_start(long period_us)
+{
+  pthread_t thread;
+  sampler_period_us = period_us;
+  if (pthread_create(&thread, NULL, sampler_run, NULL)) {
+    printf("Could not start the SPI sampler...\r\n");
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
 
-    sumVolt += volt;
+int spi_sampler_read(uint32_t *cursor, struct spi_sample *out, int max)
+{
+  unsigned head = atomic_load_explicit(&sampler_head, memory_order_acquire);
+  unsigned from = *cursor;
+  // The slot at head may be half written, so one less than the ring holds
+  if (head - from > SPI_SAMPLER_RING_SIZE - 1)
+    from = head - (SPI_SAMPLER_RING_SIZE - 1);
+
+  int n = 0;
+  for (unsigned i = from; i != head && n < max; i++)
+    out[n++] = sampler_ring[i & (SPI_SAMPLER_RING_SIZE - 1)];
+
+  /* Drop what the sampler overwrote while we copied: sample i is intact
+     while the sampler is less than a full ring ahead of it */
+  atomic_thread_fence(memory_order_acquire);
+  unsigned now = atomic_load_explicit(&sampler_head, memory_order_relaxed);
+  int copied = n;
+  int stale = (int)(now - (SPI_SAMPLER_RING_SIZE - 1) - from);
+  if (stale > 0) {
+    if (stale > n)
+      stale = n;
+    memmove(out, out + stale, sizeof(*out) * (n - stale));
+    n -= stale;
   }
-  avgVolt = sumVolt / num_read;
-  return avgVolt;
+  *cursor = from + copied;
+  return n;
+}
+
+int spi_sampler_latest(struct spi_sample *sample)
+{
+  uint32_t cursor =
+      atomic_load_explicit(&sampler_head, memory_order_acquire) - 1;
+  if (cursor == (uint32_t)-1)
+    return -1;
+  return spi_sampler_read(&cursor, sample, 1) == 1 ? 0 : -1;
 }
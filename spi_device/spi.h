@@ -1,5 +1,16 @@
 #ifndef SPI_BASE_H
 #define SPI_BASE_H
+#include <stdint.h>
+#include <time.h>
+
+#define SPI_CHANNELS 4
+#define SPI_MAX_TRANSFERS 256 // Per ioctl, SPI_MSGSIZE must fit in 14 bits
+#define SPI_SAMPLER_RING_SIZE 64 // Power of two
+
+struct spi_sample {
+  struct timespec time; // CLOCK_MONOTONIC
+  uint16_t adc[SPI_CHANNELS];
+};
 
 int spi_init();
 
@@ -7,4 +18,22 @@ uint16_t get_raw_voltage(int channel);
 
 float get_avg_voltage(int channel, int num_read);
 
+// Converts channels 0 to SPI_CHANNELS - 1 in a single ioctl
+int spi_read_all(uint16_t values[SPI_CHANNELS]);
+
+/* samples rounds over all channels, values interleaved by channel, in as
+   few ioctls as SPI_MAX_TRANSFERS allows */
+int spi_read_samples(int samples, uint16_t *values);
+
+/* Reads all channels every period_us on its own thread into a ring, so
+   readers never wait on the bus. Wakeups are absolute, they do not drift. */
+int spi_sampler_start(long period_us);
+
+// Most recent sample, -1 if there is none yet
+int spi_sampler_latest(struct spi_sample *sample);
+
+/* Copies up to max samples taken after *cursor, oldest first, and moves
+   *cursor on. Samples overwritten before they were read are skipped. */
+int spi_sampler_read(uint32_t *cursor, struct spi_sample *out, int max);
+
 #endif
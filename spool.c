@@ -0,0 +1,91 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "spool.h"
+
+#define SLOT(seq) ((seq) & (SPOOL_CAPACITY - 1))
+
+static int header_valid(const struct spool_header *header) {
+  return header->magic == SPOOL_MAGIC &&
+         header->capacity == SPOOL_CAPACITY &&
+         header->head - header->tail <= SPOOL_CAPACITY;
+}
+
+int spool_open(struct spool *spool, const char *path) {
+  memset(spool, 0, sizeof(*spool));
+  spool->fd = -1;
+  spool->map_size = sizeof(struct spool_header) +
+                    sizeof(struct spool_record) * SPOOL_CAPACITY;
+
+  int valid = 0;
+  void *map;
+  if (path) {
+    spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (spool->fd < 0) {
+      perror("Could not open spool");
+      return -1;
+    }
+    struct spool_header header = {0};
+    valid = pread(spool->fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header_valid(&header);
+    if (!valid && header.magic)
+      printf("Spool %s has another layout, starting over\n", path);
+    if ((!valid && ftruncate(spool->fd, 0) < 0) ||
+        ftruncate(spool->fd, spool->map_size) < 0) {
+      perror("Could not size spool");
+      close(spool->fd);
+      return -1;
+    }
+    map = mmap(NULL, spool->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               spool->fd, 0);
+  } else {
+    map = mmap(NULL, spool->map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (map == MAP_FAILED) {
+    perror("Could not map spool");
+    if (spool->fd > -1)
+      close(spool->fd);
+    return -1;
+  }
+  spool->header = map;
+  spool->records = (struct spool_record *)(spool->header + 1);
+
+  if (!valid) {
+    memset(spool->header, 0, sizeof(*spool->header));
+    spool->header->magic = SPOOL_MAGIC;
+    spool->header->capacity = SPOOL_CAPACITY;
+  } else if (spool_count(spool)) {
+    printf("Spool %s holds %u undelivered samples\n", path,
+           spool_count(spool));
+  }
+  return 0;
+}
+
+uint32_t spool_count(const struct spool *spool) {
+  return spool->header->head - spool->header->tail;
+}
+
+void spool_push(struct spool *spool, uint32_t time,
+                const uint8_t msg_A[MSG_SIZE]) {
+  struct spool_header *header = spool->header;
+  struct spool_record *record = &spool->records[SLOT(header->head)];
+  record->time = time;
+  memcpy(record->msg_A, msg_A, MSG_SIZE);
+  if (header->head - header->tail == SPOOL_CAPACITY)
+    header->tail++;
+  header->head++;
+}
+
+const struct spool_record *spool_get(const struct spool *spool, uint32_t seq) {
+  return &spool->records[SLOT(seq)];
+}
+
+void spool_release(struct spool *spool, uint32_t seq) {
+  // Records overwritten while the upload was in flight are already gone
+  if (seq - spool->header->tail <= spool_count(spool))
+    spool->header->tail = seq;
+}
@@ -0,0 +1,49 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define SPOOL_MAGIC 0x4c4f5053 // "SPOL"
+#define SPOOL_CAPACITY 2048 // Power of two, over 5 hours of 10 s Msg A
+
+/* Layout of the spool file, never reordered: change SPOOL_MAGIC when a field
+   changes. head and tail are free-running sequence numbers. */
+struct spool_header {
+  uint32_t magic;
+  uint32_t capacity;
+  uint32_t head; // Next record written
+  uint32_t tail; // Oldest record not yet delivered
+};
+
+struct spool_record {
+  uint32_t time; // Seconds since the epoch
+  uint8_t msg_A[MSG_SIZE];
+};
+
+/* Bounded store-and-forward buffer of the Msg A samples taken while the
+   server is unreachable. Once full the oldest record is overwritten. Kept in
+   a memory-mapped file when a path is given, so the records survive a
+   restart, else in anonymous memory. */
+struct spool {
+  int fd;
+  struct spool_header *header;
+  struct spool_record *records;
+  size_t map_size;
+};
+
+int spool_open(struct spool *spool, const char *path);
+
+uint32_t spool_count(const struct spool *spool);
+
+void spool_push(struct spool *spool, uint32_t time,
+                const uint8_t msg_A[MSG_SIZE]);
+
+// Record seq, valid for tail <= seq < head
+const struct spool_record *spool_get(const struct spool *spool, uint32_t seq);
+
+// Drops the records before seq once they were delivered
+void spool_release(struct spool *spool, uint32_t seq);
+
+#endif
@@ -0,0 +1,75 @@
+#include <time.h>
+
+#include "stats.h"
+
+#define SUB_COUNT (1 << STATS_SUB_BITS)
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+  if (value >= (uint64_t)1 << STATS_MAX_BITS)
+    value = ((uint64_t)1 << STATS_MAX_BITS) - 1;
+  if (value < SUB_COUNT)
+    return value;
+  int exp = 63 - __builtin_clzll(value);
+  int sub = (value >> (exp - STATS_SUB_BITS)) & (SUB_COUNT - 1);
+  return ((exp - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+// Largest value that falls in bucket index
+static uint64_t bucket_upper(int index) {
+  if (index < SUB_COUNT)
+    return index;
+  int exp = (index >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  uint64_t sub = index & (SUB_COUNT - 1);
+  return ((SUB_COUNT + sub + 1) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+void stats_record(struct stats_histogram *hist, uint64_t value) {
+  stats_add(&hist->buckets[bucket_index(value)], 1);
+  stats_add(&hist->count, 1);
+  stats_add(&hist->sum, value);
+  if (value > stats_read(&hist->max))
+    atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+}
+
+void stats_record_since(struct stats_histogram *hist, uint64_t start) {
+  stats_record(hist, stats_now() - start);
+}
+
+void stats_merge(struct stats_histogram *into,
+                 const struct stats_histogram *from) {
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    stats_add(&into->buckets[i], stats_read(&from->buckets[i]));
+  stats_add(&into->count, stats_read(&from->count));
+  stats_add(&into->sum, stats_read(&from->sum));
+  if (stats_read(&from->max) > stats_read(&into->max))
+    atomic_store_explicit(&into->max, stats_read(&from->max),
+                          memory_order_relaxed);
+}
+
+uint64_t stats_quantile(const struct stats_histogram *hist, double q) {
+  // Bucket sums rather than count, the writer may be between the two
+  uint64_t total = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    total += stats_read(&hist->buckets[i]);
+  if (total == 0)
+    return 0;
+  uint64_t rank = q * total;
+  if (rank >= total)
+    rank = total - 1;
+  uint64_t max = stats_read(&hist->max);
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += stats_read(&hist->buckets[i]);
+    if (seen > rank) {
+      uint64_t upper = bucket_upper(i);
+      return upper < max ? upper : max;
+    }
+  }
+  return max;
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Octaves are split in 1 << STATS_SUB_BITS buckets, about 12% precision
+#define STATS_SUB_BITS 3
+#define STATS_MAX_BITS 40 // Values are clamped below 2^40, 18 minutes in ns
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/* Counters and histograms have a single writer, the thread that owns them,
+   and are read by the stats reporter on another thread. Updates are a
+   relaxed load and store, no locked instruction or fence. */
+typedef _Atomic uint64_t stats_counter;
+
+/* Log-linear latency histogram in the style of HdrHistogram: bucket width
+   grows with the value, so the relative error is the same everywhere. */
+struct stats_histogram {
+  stats_counter count;
+  stats_counter sum;
+  stats_counter max;
+  stats_counter buckets[STATS_BUCKETS];
+};
+
+static inline void stats_add(stats_counter *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline uint64_t stats_read(const stats_counter *counter) {
+  return atomic_load_explicit((stats_counter *)counter, memory_order_relaxed);
+}
+
+// Monotonic time in ns
+uint64_t stats_now(void);
+
+void stats_record(struct stats_histogram *hist, uint64_t value);
+
+// Records the time since start, a stats_now() timestamp
+void stats_record_since(struct stats_histogram *hist, uint64_t start);
+
+// Adds the buckets of from into into, for reporting across threads
+void stats_merge(struct stats_histogram *into,
+                 const struct stats_histogram *from);
+
+/* Value at quantile q (0 to 1), the upper bound of the bucket holding it
+   but never more than the recorded maximum. 0 if nothing was recorded. */
+uint64_t stats_quantile(const struct stats_histogram *hist, double q);
+
+#endif
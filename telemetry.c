@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "server.h"
+#include "telemetry.h"
+
+void msg_A_pack(uint8_t buffer[MSG_SIZE], const struct msg_A_fields *fields) {
+  buffer[0] = MSG_TYPE_A;
+  buffer[1] = fields->passcode & 0xFF;
+  buffer[2] = fields->passcode >> 8;
+  buffer[3] = fields->device_id;
+  buffer[4] = fields->rssi;
+
+  for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++) {
+    buffer[5 + 2 * ch] = fields->adc[ch] & 0xFF;       // 8 bits
+    buffer[6 + 2 * ch] = (fields->adc[ch] >> 8) & 0x3; // MSB 2 bits
+  }
+
+  buffer[13] = fields->rem_cut_off_time & 0xFF;
+  buffer[14] = (fields->rem_cut_off_time >> 8) & 0xFF;
+  buffer[15] = fields->gpio;
+}
+
+void msg_A_unpack(const uint8_t buffer[MSG_SIZE],
+                  struct msg_A_fields *fields) {
+  fields->passcode = buffer[1] | buffer[2] << 8;
+  fields->device_id = buffer[3];
+  fields->rssi = buffer[4];
+  for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+    fields->adc[ch] = buffer[5 + 2 * ch] | (buffer[6 + 2 * ch] & 0x3) << 8;
+  fields->rem_cut_off_time = buffer[13] | buffer[14] << 8;
+  fields->gpio = buffer[15];
+}
+
+int msg_A1_init(uint8_t *buffer, const uint8_t msg_A[MSG_SIZE]) {
+  buffer[0] = MSG_TYPE_A1;
+  memcpy(buffer + 1, msg_A + 1, 3); // Passcode and device id
+  buffer[MSG_A1_COUNT_IDX] = 0;
+  return MSG_A1_HEADER_SIZE;
+}
+
+int msg_A1_add(uint8_t *buffer, const uint8_t msg_A[MSG_SIZE], uint32_t age) {
+  int count = buffer[MSG_A1_COUNT_IDX];
+  uint8_t *sample = buffer + MSG_A1_HEADER_SIZE + count * MSG_A1_SAMPLE_SIZE;
+  for (int i = 0; i < 4; i++)
+    sample[i] = age >> (8 * i);
+  memcpy(sample + 4, msg_A + 4, MSG_SIZE - 4);
+  buffer[MSG_A1_COUNT_IDX] = ++count;
+  return MSG_A1_HEADER_SIZE + count * MSG_A1_SAMPLE_SIZE;
+}
+
+uint32_t msg_A1_sample(const uint8_t *buffer, int index,
+                       uint8_t msg_A[MSG_SIZE]) {
+  const uint8_t *sample =
+      buffer + MSG_A1_HEADER_SIZE + index * MSG_A1_SAMPLE_SIZE;
+  msg_A[0] = MSG_TYPE_A;
+  memcpy(msg_A + 1, buffer + 1, 3);
+  memcpy(msg_A + 4, sample + 4, MSG_SIZE - 4);
+  return sample[0] | sample[1] << 8 | sample[2] << 16 |
+         (uint32_t)sample[3] << 24;
+}
+
+#define ADC_BITS 10
+
+// Bit stream, least significant bit first, through a 64-bit accumulator
+struct bit_stream {
+  uint8_t *data;
+  uint64_t acc;
+  int bits;
+};
+
+static void put_bits(struct bit_stream *stream, uint32_t value, int bits) {
+  stream->acc |= (uint64_t)(value & ((1u << bits) - 1)) << stream->bits;
+  stream->bits += bits;
+  while (stream->bits >= 8) {
+    *stream->data++ = stream->acc;
+    stream->acc >>= 8;
+    stream->bits -= 8;
+  }
+}
+
+static void flush_bits(struct bit_stream *stream) {
+  if (stream->bits > 0)
+    *stream->data++ = stream->acc;
+}
+
+// Reads no byte past the one holding the last bit asked for
+static uint32_t get_bits(struct bit_stream *stream, int bits) {
+  while (stream->bits < bits) {
+    stream->acc |= (uint64_t)*stream->data++ << stream->bits;
+    stream->bits += 8;
+  }
+  uint32_t value = stream->acc & ((1u << bits) - 1);
+  stream->acc >>= bits;
+  stream->bits -= bits;
+  return value;
+}
+
+static uint32_t zigzag(int delta) {
+  return delta >= 0 ? 2 * delta : -2 * delta - 1;
+}
+
+static int unzigzag(uint32_t value) {
+  return value & 1 ? -(int)(value >> 1) - 1 : (int)(value >> 1);
+}
+
+// Channel ch of sample i relative to sample i - 1
+static int delta(const struct msg_A2_fields *fields, int i, int ch) {
+  return (fields->adc[i][ch] & 0x3FF) - (fields->adc[i - 1][ch] & 0x3FF);
+}
+
+static int a2_length(int count, int width) {
+  return MSG_A2_HEADER_SIZE +
+         (4 * ADC_BITS + (count - 1) * 4 * width + 7) / 8;
+}
+
+int msg_A2_pack(uint8_t *buffer, const struct msg_A2_fields *fields) {
+  int count = fields->count;
+  int width = 0;
+  for (int i = 1; i < count; i++) {
+    for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++) {
+      uint32_t z = zigzag(delta(fields, i, ch));
+      while (z >> width)
+        width++;
+    }
+  }
+
+  int len = a2_length(count, width);
+  memset(buffer, 0, len);
+  buffer[0] = MSG_TYPE_A2;
+  buffer[1] = fields->passcode & 0xFF;
+  buffer[2] = fields->passcode >> 8;
+  buffer[3] = fields->device_id;
+  buffer[4] = fields->rssi;
+  buffer[5] = fields->rem_cut_off_time & 0xFF;
+  buffer[6] = fields->rem_cut_off_time >> 8;
+  buffer[7] = fields->gpio;
+  buffer[8] = fields->interval;
+  buffer[9] = fields->age;
+  buffer[MSG_A2_COUNT_IDX] = count;
+  buffer[11] = width;
+
+  struct bit_stream stream = {buffer + MSG_A2_HEADER_SIZE, 0, 0};
+  for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+    put_bits(&stream, fields->adc[0][ch], ADC_BITS);
+  for (int i = 1; i < count; i++) {
+    for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+      put_bits(&stream, zigzag(delta(fields, i, ch)), width);
+  }
+  flush_bits(&stream);
+  return len;
+}
+
+int msg_A2_unpack(const uint8_t *buffer, size_t len,
+                  struct msg_A2_fields *fields) {
+  if (len < MSG_A2_HEADER_SIZE)
+    return -1;
+  int count = buffer[MSG_A2_COUNT_IDX];
+  int width = buffer[11];
+  if (count < 1 || count > MSG_A2_MAX_SAMPLES || width > ADC_BITS + 1 ||
+      (size_t)a2_length(count, width) > len)
+    return -1;
+
+  fields->passcode = buffer[1] | buffer[2] << 8;
+  fields->device_id = buffer[3];
+  fields->rssi = buffer[4];
+  fields->rem_cut_off_time = buffer[5] | buffer[6] << 8;
+  fields->gpio = buffer[7];
+  fields->interval = buffer[8];
+  fields->age = buffer[9];
+  fields->count = count;
+
+  struct bit_stream stream = {(uint8_t *)buffer + MSG_A2_HEADER_SIZE, 0, 0};
+  for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+    fields->adc[0][ch] = get_bits(&stream, ADC_BITS);
+  for (int i = 1; i < count; i++) {
+    for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+      fields->adc[i][ch] =
+          (fields->adc[i - 1][ch] + unzigzag(get_bits(&stream, width))) &
+          0x3FF;
+  }
+  return 0;
+}
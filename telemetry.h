@@ -0,0 +1,78 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define TELEMETRY_ADC_CHANNELS 4
+
+/* Msg A, 16 bytes:
+   [type][passcode, 2 bytes][device id][rssi][ADC 0..3, 2 bytes each, low
+   byte first, 10 bits][remaining cut-off minutes, 2 bytes][GPIO states] */
+struct msg_A_fields {
+  uint16_t passcode;
+  uint8_t device_id;
+  int8_t rssi;
+  uint16_t adc[TELEMETRY_ADC_CHANNELS];
+  uint16_t rem_cut_off_time;
+  uint8_t gpio;
+};
+
+void msg_A_pack(uint8_t buffer[MSG_SIZE], const struct msg_A_fields *fields);
+
+void msg_A_unpack(const uint8_t buffer[MSG_SIZE], struct msg_A_fields *fields);
+
+/* Msg A1, Msg A samples a device buffered while offline, oldest first:
+   [type][passcode, 2 bytes][device id][sample count][samples]
+   Each sample is [age in seconds when sent, 4 bytes] followed by bytes 4..15
+   of its Msg A: [rssi][ADC 0..3][remaining cut-off minutes][GPIO states] */
+#define MSG_A1_COUNT_IDX 4
+#define MSG_A1_HEADER_SIZE 5
+#define MSG_A1_SAMPLE_SIZE 16
+#define MSG_A1_MAX_SAMPLES 7 // Fits an AES_MSG_SIZE payload
+
+/* Starts an A1 with the header of msg_A and no samples, then adds one
+   sample. Both return the length of the A1 so far. */
+int msg_A1_init(uint8_t *buffer, const uint8_t msg_A[MSG_SIZE]);
+
+int msg_A1_add(uint8_t *buffer, const uint8_t msg_A[MSG_SIZE], uint32_t age);
+
+// Rebuilds sample index of an A1 as a Msg A. Returns its age in seconds
+uint32_t msg_A1_sample(const uint8_t *buffer, int index,
+                       uint8_t msg_A[MSG_SIZE]);
+
+/* Msg A2, bit-packed samples taken every interval seconds:
+   [type][passcode, 2 bytes][device id][rssi][remaining cut-off minutes,
+   2 bytes][GPIO states][interval][age of the last sample in seconds]
+   [sample count][delta width]
+   then a bit stream, least significant bit first: the four 10-bit ADC
+   channels of the first sample in 5 bytes, then for every further sample
+   the difference of each channel to the previous sample, zigzag encoded in
+   delta width bits. rssi, cut-off and GPIO are those of the last sample. */
+#define MSG_A2_COUNT_IDX 10
+#define MSG_A2_HEADER_SIZE 12
+#define MSG_A2_MAX_SAMPLES 16
+#define MSG_A2_MAX_SIZE                                                        \
+  (MSG_A2_HEADER_SIZE + 5 + ((MSG_A2_MAX_SAMPLES - 1) * 4 * 11 + 7) / 8)
+
+struct msg_A2_fields {
+  uint16_t passcode;
+  uint8_t device_id;
+  int8_t rssi;
+  uint16_t rem_cut_off_time;
+  uint8_t gpio;
+  uint8_t interval;
+  uint8_t age;
+  uint8_t count;
+  uint16_t adc[MSG_A2_MAX_SAMPLES][TELEMETRY_ADC_CHANNELS];
+};
+
+// Returns the length of the A2, at most MSG_A2_MAX_SIZE
+int msg_A2_pack(uint8_t *buffer, const struct msg_A2_fields *fields);
+
+// Returns -1 if the header is invalid or the A2 is longer than len
+int msg_A2_unpack(const uint8_t *buffer, size_t len,
+                  struct msg_A2_fields *fields);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+static void fill_header(struct msg_A2_fields *fields, int count) {
+  memset(fields, 0, sizeof(*fields));
+  fields->passcode = 0xBEEF;
+  fields->device_id = 42;
+  fields->rssi = -71;
+  fields->rem_cut_off_time = 1234;
+  fields->gpio = 0xA5;
+  fields->interval = 10;
+  fields->age = 3;
+  fields->count = count;
+}
+
+// Packs fields, checks the delta width and that unpacking gives them back
+static int round_trip(const char *name, const struct msg_A2_fields *fields,
+                      int width) {
+  uint8_t buffer[MSG_A2_MAX_SIZE];
+  struct msg_A2_fields out;
+  int len = msg_A2_pack(buffer, fields);
+  if (len > MSG_A2_MAX_SIZE || buffer[11] != width) {
+    printf("%s: length %d, width %d\n", name, len, buffer[11]);
+    return -1;
+  }
+  memset(&out, 0xFF, sizeof(out));
+  if (msg_A2_unpack(buffer, len, &out) != 0) {
+    printf("%s: rejected\n", name);
+    return -1;
+  }
+  if (out.passcode != fields->passcode || out.device_id != fields->device_id ||
+      out.rssi != fields->rssi ||
+      out.rem_cut_off_time != fields->rem_cut_off_time ||
+      out.gpio != fields->gpio || out.interval != fields->interval ||
+      out.age != fields->age || out.count != fields->count ||
+      memcmp(out.adc, fields->adc, fields->count * sizeof(out.adc[0])) != 0) {
+    printf("%s: unpacked fields differ\n", name);
+    return -1;
+  }
+  // Any shorter buffer is refused, down to none at all
+  for (int i = 0; i < len; i++) {
+    if (msg_A2_unpack(buffer, i, &out) != -1) {
+      printf("%s: accepted %d of %d bytes\n", name, i, len);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(void) {
+  struct msg_A2_fields fields;
+  int counts[] = {1, MSG_A2_MAX_SAMPLES};
+
+  for (int c = 0; c < 2; c++) {
+    int count = counts[c];
+    char name[32];
+
+    // Constant samples need no delta bits
+    fill_header(&fields, count);
+    for (int i = 0; i < count; i++)
+      for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+        fields.adc[i][ch] = 100 * ch + 7;
+    snprintf(name, sizeof(name), "width 0, count %d", count);
+    if (round_trip(name, &fields, 0) != 0)
+      return -1;
+
+    // Full swings of -1023 and +1023 need the widest deltas
+    fill_header(&fields, count);
+    for (int i = 0; i < count; i++)
+      for (int ch = 0; ch < TELEMETRY_ADC_CHANNELS; ch++)
+        fields.adc[i][ch] = (i + ch) % 2 ? 1023 : 0;
+    int width = count > 1 ? 11 : 0;
+    snprintf(name, sizeof(name), "width %d, count %d", width, count);
+    if (round_trip(name, &fields, width) != 0)
+      return -1;
+  }
+
+  printf("Pass\n");
+  return 0;
+}
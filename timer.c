@@ -1,42 +1,57 @@
 #include "timer.h"
-#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
-void adjust_timer(int sec, int interval, void (*handler)(union sigval),
-                  timer_w_t *timer, int userint) {
-  if (!timer->isValid) {
-    printf("Error: timer should be running but not!\n");
-    start_timer(sec, interval, handler, timer, userint);
+static void on_timer(struct event_loop *loop, int fd, uint32_t events,
+                     void *data) {
+  timer_w_t *timer = data;
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
     return;
+  struct itimerspec current_its;
+  timerfd_gettime(fd, &current_its);
+  if (current_its.it_value.tv_sec == 0 && current_its.it_value.tv_nsec == 0)
+    timer->isValid = false;
+  timer->handler(timer->data);
+}
+
+int timer_init(timer_w_t *timer, struct event_loop *loop,
+               timer_handler_t handler, void *data) {
+  memset(timer, 0, sizeof(*timer));
+  timer->handler = handler;
+  timer->data = data;
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->fd < 0) {
+    perror("timerfd_create failed");
+    return -1;
   }
-  struct itimerspec its;
+  return event_loop_add(loop, timer->fd, EVENT_READ, on_timer, timer);
+}
 
-  its.it_value.tv_sec = sec;
-  its.it_value.tv_nsec = 0;
-  its.it_interval.tv_sec = interval;
-  its.it_interval.tv_nsec = 0;
-  timer_settime(timer->timerid, 0, &its, NULL);
+void adjust_timer(int sec, int interval, timer_w_t *timer) {
+  if (!timer->isValid)
+    printf("Error: timer should be running but not!\n");
+  start_timer(sec, interval, timer);
 }
 
-void start_timer(int sec, int interval, void (*handler)(union sigval),
-                 timer_w_t *timer, int userint) {
-  struct sigevent sev;
+void start_timer(int sec, int interval, timer_w_t *timer) {
+  start_timer_ms(sec * 1000L, interval * 1000L, timer);
+}
+
+void start_timer_ms(long ms, long interval_ms, timer_w_t *timer) {
   struct itimerspec its;
 
-  memset(&sev, 0, sizeof(sev));
-  sev.sigev_notify = SIGEV_THREAD;
-  sev.sigev_notify_function = handler;
-  sev.sigev_value.sival_int = userint;
-  sev.sigev_notify_attributes = NULL;
-  timer_create(CLOCK_REALTIME, &sev, &timer->timerid);
-
-  its.it_value.tv_sec = sec;
-  its.it_value.tv_nsec = 0;
-  its.it_interval.tv_sec = interval;
-  its.it_interval.tv_nsec = 0;
-  timer_settime(timer->timerid, 0, &its, NULL);
+  // A zero it_value would disarm the timer, fire right away instead
+  if (ms <= 0)
+    ms = 1;
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  timerfd_settime(timer->fd, 0, &its, NULL);
   timer->isValid = true;
 }
 
@@ -45,7 +60,7 @@ int get_timer_state(timer_w_t *timer) {
     return 0;
   // Get the current state of the timer
   struct itimerspec current_its;
-  timer_gettime(timer->timerid, &current_its);
+  timerfd_gettime(timer->fd, &current_its);
   return (current_its.it_value.tv_sec / 60);
 }
 
@@ -53,6 +68,8 @@ void stop_timer(timer_w_t *timer) {
   if (!timer->isValid)
     return;
 
-  timer_delete(timer->timerid);
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  timerfd_settime(timer->fd, 0, &its, NULL);
   timer->isValid = false;
 }
@@ -1,20 +1,30 @@
 #ifndef TIMER_H
 #define TIMER_H
-#include <signal.h>
 #include <stdbool.h>
-#include <time.h>
 
+#include "event_loop/event_loop.h"
+
+typedef void (*timer_handler_t)(void *data);
+
+/* One timerfd watched by an event loop. The handler runs on the loop's
+   thread, once per wakeup even if the timer expired more than once. */
 typedef struct {
-  timer_t timerid;
-  bool isValid;
+  int fd;
+  bool isValid; // Armed
+  timer_handler_t handler;
+  void *data;
 } timer_w_t;
 
-void adjust_timer(int sec, int interval, void (*handler)(union sigval),
-                  timer_w_t *timer, int userint);
+int timer_init(timer_w_t *timer, struct event_loop *loop,
+               timer_handler_t handler, void *data);
+
+void adjust_timer(int sec, int interval, timer_w_t *timer);
+
+void start_timer(int sec, int interval, timer_w_t *timer);
 
-void start_timer(int sec, int interval, void (*handler)(union sigval),
-                 timer_w_t *timer, int userint);
+void start_timer_ms(long ms, long interval_ms, timer_w_t *timer);
 
+// Whole minutes left, 0 if the timer is not armed
 int get_timer_state(timer_w_t *timer);
 
 void stop_timer(timer_w_t *timer);